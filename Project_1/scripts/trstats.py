@@ -1,4 +1,4 @@
-from json import dump
+from json import dump, load
 from re import findall
 from time import sleep
 from subprocess import run
@@ -37,6 +37,14 @@ def main():
                         output stored in the text files",
     )
 
+    parser.add_argument(
+        "--native",
+        dest="native",
+        default="",
+        help="Path to the tcp_traceroute binary of Project 4. If present, it runs all num_runs traces and computes \
+                        the per-hop stats itself, and its JSON output is used instead of parsing traceroute text",
+    )
+
     # Assign arguments to variables
     args = parser.parse_args()
     num_runs = int(args.num_runs)
@@ -46,6 +54,17 @@ def main():
     graph = args.graph
     target = args.target
     test_dir = args.test_dir
+    native = args.native
+
+    # Let tcp_traceroute aggregate the runs and only plot its JSON output
+    if native != "" and test_dir == "":
+        run(
+            [native, "-t", target, "-m", f"{max_hops}", "-n", f"{num_runs}", "-d", f"{run_delay}", "-o", output],
+            check=True,
+        )
+        with open(output) as json_file:
+            plot_native(load(json_file), graph)
+        return
 
     # Define global variables to be used later
     hops = None
@@ -143,20 +162,50 @@ def main():
 
     # Plot
     plt.figure(figsize=(12, 8))
-    plt.boxplot(
-        hops_times,
+    plot_style(plt.boxplot, hops_times)
+    plt.xlabel("Hop")
+    plt.ylabel("Time (ms)")
+    plt.title("Traceroute Box Plot")
+    plt.savefig(graph, dpi=300, bbox_inches="tight")
+    plt.show()
+
+
+def plot_native(json_output, graph):
+    # Build the box of every hop from the quartiles computed by tcp_traceroute
+    stats = [
+        {
+            "label": str(hop["hop"]),
+            "whislo": hop["min"],
+            "q1": hop["p25"],
+            "med": hop["med"],
+            "q3": hop["p75"],
+            "whishi": hop["max"],
+        }
+        for hop in json_output
+    ]
+
+    # Plot
+    fig, ax = plt.subplots(figsize=(12, 8))
+    plot_style(ax.bxp, stats, showfliers=False)
+    ax.set_xlabel("Hop")
+    ax.set_ylabel("Time (ms)")
+    ax.set_title("Traceroute Box Plot")
+    fig.savefig(graph, dpi=300, bbox_inches="tight")
+    plt.show()
+
+
+def plot_style(plot, data, **kwargs):
+    # Draw the boxes with the colors used by every plot of this script
+    plot(
+        data,
         patch_artist=True,
         boxprops=dict(facecolor="cornflowerblue", color="midnightblue"),
         medianprops=dict(color="red"),
         whiskerprops=dict(color="midnightblue"),
         capprops=dict(color="midnightblue"),
         flierprops=dict(markerfacecolor="cornflowerblue", markeredgecolor="midnightblue", markersize=3),
+        **kwargs,
     )
-    plt.xlabel("Hop")
-    plt.ylabel("Time (ms)")
-    plt.title("Traceroute Box Plot")
-    plt.savefig(graph, dpi=300, bbox_inches="tight")
-    plt.show()
 
 
 if __name__ == "__main__":
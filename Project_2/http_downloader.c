@@ -5,110 +5,609 @@
 #define _GNU_SOURCE
 
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 #include <openssl/ssl.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-// Define a struct so multiple arguments can be passed with threading
+// Define the retry backoff, the first retry waits up to BACKOFF_BASE seconds
+// and each one after that up to twice as long, capped at BACKOFF_MAX
+#define BACKOFF_BASE 0.5
+#define BACKOFF_MAX 30.0
+
+// Define the largest response header that is accepted
+#define HEADER_MAX 16384
+
+// Define the most plaintext a single TLS record holds
+#define TLS_RECORD_MAX 16384
+
+// Define the block size that direct writes are aligned to
+#define DIRECT_BLOCK 4096
+
+// Define the size of the reads of the plain read path of "-a"
+#define PLAIN_READ 4096
+
+// Define a struct for a byte range of the object that still has to be
+// downloaded, part is the range it was split from
 typedef struct {
   int part;
+  long long start;
+  long long end;
+  int attempts;
+  double not_before;
+} RangeTask;
+
+// Define a struct for the pool of page-aligned buffers that the download
+// threads fill with body data and the writer empties, a thread waits for a
+// free buffer when all of them are in use, which bounds the memory used
+typedef struct {
+  char *memory;
+  char **free;
+  int free_count;
+  int count;
+  size_t size;
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+} BufferPool;
+
+// Define a struct for a filled buffer waiting to be written, the bytes from
+// lead to fill go to the file offset base + lead, base is block-aligned
+typedef struct {
+  char *buffer;
+  long long base;
+  size_t lead;
+  size_t fill;
+} WriteJob;
+
+// Define a struct for the writer thread and the queue of buffers it writes,
+// whole blocks go through the O_DIRECT descriptor if the filesystem supports
+// it and the partial blocks at the edges of ranges through the other one
+typedef struct {
+  int fd;
+  int direct_fd;
+  BufferPool *pool;
+  WriteJob *jobs;
+  int head;
+  int queued;
+  int closing;
+  int failed;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} FileWriter;
+
+// Define a struct for the state shared by all download threads, the ranges
+// waiting to be downloaded are kept in a queue that failed ranges go back to
+typedef struct {
   char *host;
   char *path;
-  int start;
-  int end;
+  struct sockaddr_in *servers;
+  int server_count;
+  SSL_CTX *ctx;
+  int max_retries;
+  double timeout;
+  const char *if_range;
+  BufferPool *pool;
+  FileWriter *writer;
+  int rcvbuf;
+  int rcvlowat;
+  int plain_reads;
+  char *congestion;
+  long long socket_reads;
+  long long bytes;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  RangeTask *queue;
+  int queued;
+  int active;
+  int failed;
+} Scheduler;
+
+// Define a struct so multiple arguments can be passed with threading
+typedef struct {
+  int worker;
+  Scheduler *scheduler;
 } ThreadArguments;
 
-void *range_download(void *arg) {
-  ThreadArguments *args = (ThreadArguments *)arg;
-  // Define struct for URL
-  struct addrinfo hints, *res;
+double monotonic_seconds() {
+  // Read the monotonic clock, which never jumps with the wall clock
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-  // Fill hints with zeros so that we can specidy sokcet type
-  memset(&hints, 0, sizeof hints);
+long long read_syscalls() {
+  // Read the number of read() system calls made by all threads so far, the
+  // TLS sessions read their sockets with read(), -1 if it is not accounted
+  long long count = -1;
+  FILE *fp = fopen("/proc/self/io", "r");
+  if (!fp) {
+    return -1;
+  }
+  char line[128];
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "syscr: %lld", &count) == 1) {
+      break;
+    }
+  }
+  fclose(fp);
+  return count;
+}
 
-  // Define hints, AF_INET=IPV4, SOCK_STREAM=TCP
-  hints.ai_family = AF_INET;  // IPv4
-  hints.ai_socktype = SOCK_STREAM;
+double retry_delay(int attempts, unsigned int *seed) {
+  // Double the delay with every attempt up to the cap, then pick a random
+  // point in its upper half so retries of many ranges do not line up
+  double delay = BACKOFF_BASE;
+  for (int i = 1; i < attempts && delay < BACKOFF_MAX; i++) {
+    delay *= 2;
+  }
+  if (delay > BACKOFF_MAX) {
+    delay = BACKOFF_MAX;
+  }
+  return delay / 2 + delay / 2 * rand_r(seed) / RAND_MAX;
+}
 
-  // Get the resolved URL
-  int ip = getaddrinfo(args->host, NULL, &hints, &res);
+long count_socket_reads(BIO *bio, int oper, const char *argp, size_t len,
+                        int argi, long argl, int ret, size_t *processed) {
+  (void)argp;
+  (void)len;
+  (void)argi;
+  (void)argl;
+  (void)processed;
+
+  // Count every read of the TLS session from its socket BIO, each BIO read
+  // is one read() of the socket
+  if (oper == (BIO_CB_READ | BIO_CB_RETURN)) {
+    Scheduler *scheduler = (Scheduler *)BIO_get_callback_arg(bio);
+    __atomic_fetch_add(&scheduler->socket_reads, 1, __ATOMIC_RELAXED);
+  }
+  return ret;
+}
 
-  // Check that the URL resolved correctly
-  if (ip != 0) {
-    fprintf(stderr, "\nCouldn't resolve URL or IP: %s\n", gai_strerror(ip));
+int create_buffer_pool(BufferPool *pool, int count, size_t size) {
+  // Round the buffers up to whole blocks and allocate them in one piece on a
+  // page boundary
+  pool->size = (size + DIRECT_BLOCK - 1) / DIRECT_BLOCK * DIRECT_BLOCK;
+  pool->count = count;
+  pool->free_count = count;
+  pool->free = malloc(count * sizeof(char *));
+  if (!pool->free || posix_memalign((void **)&pool->memory,
+                                    sysconf(_SC_PAGESIZE),
+                                    count * pool->size) != 0) {
+    perror("allocate buffer pool");
+    free(pool->free);
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    pool->free[i] = pool->memory + i * pool->size;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->available, NULL);
+  return 0;
+}
+
+char *acquire_buffer(BufferPool *pool) {
+  // Wait until the writer returns a buffer if all of them are in use
+  pthread_mutex_lock(&pool->lock);
+  while (pool->free_count == 0) {
+    pthread_cond_wait(&pool->available, &pool->lock);
+  }
+  char *buffer = pool->free[--pool->free_count];
+  pthread_mutex_unlock(&pool->lock);
+  return buffer;
+}
+
+void release_buffer(BufferPool *pool, char *buffer) {
+  pthread_mutex_lock(&pool->lock);
+  pool->free[pool->free_count++] = buffer;
+  pthread_cond_signal(&pool->available);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int pwrite_all(int fd, const char *data, size_t length, long long offset) {
+  // Write all of the data, continuing after short writes
+  while (length > 0) {
+    ssize_t written = pwrite(fd, data, length, offset);
+    if (written < 0) {
+      perror("pwrite");
+      return -1;
+    }
+    data += written;
+    length -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+int write_block_range(FileWriter *writer, const char *data, size_t length,
+                      long long offset) {
+  // Split the data into the partial block before the first block boundary,
+  // the whole blocks and the partial block after the last boundary
+  long long first = (offset + DIRECT_BLOCK - 1) / DIRECT_BLOCK * DIRECT_BLOCK;
+  long long last = (offset + length) / DIRECT_BLOCK * DIRECT_BLOCK;
+  if (writer->direct_fd < 0 || first >= last) {
+    first = last = offset + length;
+  }
+
+  // Write the whole blocks directly from the buffer to the disk, and the
+  // partial blocks, which neighboring ranges share, through the page cache
+  if (pwrite_all(writer->fd, data, first - offset, offset) < 0 ||
+      pwrite_all(writer->direct_fd, data + (first - offset), last - first,
+                 first) < 0 ||
+      pwrite_all(writer->fd, data + (last - offset), offset + length - last,
+                 last) < 0) {
+    return -1;
+  }
+
+  // Without O_DIRECT, write the pages back right away and drop them from the
+  // page cache so a large download does not push other data out of it. The
+  // wait reports a writeback error only once, fdatasync() would miss it
+  if (writer->direct_fd < 0) {
+    if (sync_file_range(writer->fd, offset, length,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+      perror("sync_file_range");
+      return -1;
+    }
+    posix_fadvise(writer->fd, offset, length, POSIX_FADV_DONTNEED);
+  }
+  return 0;
+}
+
+void *writer_thread(void *arg) {
+  FileWriter *writer = (FileWriter *)arg;
+
+  pthread_mutex_lock(&writer->lock);
+  while (writer->queued > 0 || !writer->closing) {
+    // Wait for a filled buffer
+    if (writer->queued == 0) {
+      pthread_cond_wait(&writer->changed, &writer->lock);
+      continue;
+    }
+    WriteJob job = writer->jobs[writer->head];
+    writer->head = (writer->head + 1) % writer->pool->count;
+    writer->queued--;
+    int failed = writer->failed;
+    pthread_mutex_unlock(&writer->lock);
+
+    // Write the buffer, after a failure the rest are only returned to the
+    // pool
+    failed = failed ||
+                 write_block_range(writer, job.buffer + job.lead,
+                                   job.fill - job.lead,
+                                   job.base + job.lead) < 0;
+    release_buffer(writer->pool, job.buffer);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->failed = failed;
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  return NULL;
+}
+
+int submit_write(FileWriter *writer, WriteJob job) {
+  // Queue the buffer for the writer, the queue has room for every buffer of
+  // the pool so this never waits
+  pthread_mutex_lock(&writer->lock);
+  int tail = (writer->head + writer->queued) % writer->pool->count;
+  writer->jobs[tail] = job;
+  writer->queued++;
+  int failed = writer->failed;
+  pthread_cond_signal(&writer->changed);
+  pthread_mutex_unlock(&writer->lock);
+  return failed ? -1 : 0;
+}
+
+int open_file_writer(FileWriter *writer, const char *path, long long size,
+                     BufferPool *pool) {
+  // Create the file at its full size so the ranges can be written anywhere
+  // in it, allocating the blocks up front where the filesystem allows it
+  memset(writer, 0, sizeof(*writer));
+  writer->pool = pool;
+  writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (writer->fd < 0 || ftruncate(writer->fd, size) < 0) {
+    perror("open output file");
+    if (writer->fd >= 0) {
+      close(writer->fd);
+    }
+    return -1;
+  }
+
+  // Only a filesystem without fallocate() is fine, running out of space is
+  // better found now than halfway through the download
+  if (fallocate(writer->fd, 0, 0, size) < 0 && errno != EOPNOTSUPP &&
+      errno != ENOSYS) {
+    perror("fallocate output file");
+    close(writer->fd);
+    return -1;
+  }
+
+  // Open the file a second time for direct writes, some filesystems such as
+  // tmpfs do not support them
+  writer->direct_fd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+  if (writer->direct_fd < 0) {
+    printf("\nO_DIRECT is not supported for %s, writing through the page "
+           "cache\n",
+           path);
+  }
+
+  // Start the writer thread
+  writer->jobs = calloc(pool->count, sizeof(WriteJob));
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->changed, NULL);
+  int error = writer->jobs ? pthread_create(&writer->thread, NULL,
+                                            writer_thread, writer)
+                           : ENOMEM;
+  if (error != 0) {
+    fprintf(stderr, "\nFailed to start the writer: %s\n", strerror(error));
+    if (writer->direct_fd >= 0) {
+      close(writer->direct_fd);
+    }
+    close(writer->fd);
+    free(writer->jobs);
+    return -1;
+  }
+  return 0;
+}
+
+int close_file_writer(FileWriter *writer) {
+  // Let the writer finish the queued buffers and stop
+  pthread_mutex_lock(&writer->lock);
+  writer->closing = 1;
+  pthread_cond_signal(&writer->changed);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+
+  // Make sure the data is on the disk, and drop the partial blocks written
+  // through the page cache from it
+  int failed = writer->failed || fdatasync(writer->fd) < 0;
+  posix_fadvise(writer->fd, 0, 0, POSIX_FADV_DONTNEED);
+  if (writer->direct_fd >= 0) {
+    close(writer->direct_fd);
+  }
+  failed = close(writer->fd) < 0 || failed;
+  free(writer->jobs);
+  return failed ? -1 : 0;
+}
+
+int hash_file(const char *path, BufferPool *pool, unsigned char *hash) {
+  // Read the file back with O_DIRECT where possible, into a buffer of the
+  // pool, so hashing it does not fill the page cache either
+  int fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+  if (fd < 0) {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  }
+  if (fd < 0) {
+    perror("open output file");
+    return -1;
+  }
+  char *buffer = acquire_buffer(pool);
+  EVP_MD_CTX *digest = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(digest, EVP_sha256(), NULL);
+  ssize_t bytes;
+  while ((bytes = read(fd, buffer, pool->size)) > 0) {
+    EVP_DigestUpdate(digest, buffer, bytes);
+  }
+  EVP_DigestFinal_ex(digest, hash, NULL);
+  EVP_MD_CTX_free(digest);
+  release_buffer(pool, buffer);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+  return bytes < 0 ? -1 : 0;
+}
+
+// Define a struct for the buffer a download thread is filling with the body
+// of its range, the buffer starts at the block holding the next byte
+typedef struct {
+  BufferPool *pool;
+  FileWriter *writer;
+  char *buffer;
+  long long base;
+  size_t lead;
+  size_t fill;
+  long long position;
+} RangeBuffer;
+
+int flush_range_buffer(RangeBuffer *range) {
+  // Hand the filled part of the buffer to the writer
+  int status = 0;
+  if (range->buffer && range->fill > range->lead) {
+    status = submit_write(range->writer,
+                          (WriteJob){.buffer = range->buffer,
+                                     .base = range->base,
+                                     .lead = range->lead,
+                                     .fill = range->fill});
+  } else if (range->buffer) {
+    release_buffer(range->pool, range->buffer);
+  }
+  range->buffer = NULL;
+  return status;
+}
+
+char *range_buffer_space(RangeBuffer *range, size_t *space) {
+  // Write out a full buffer and take a new one, placing the next byte at its
+  // offset within its block so whole blocks stay aligned in memory
+  if (range->buffer && range->fill == range->pool->size &&
+      flush_range_buffer(range) < 0) {
     return NULL;
   }
+  if (!range->buffer) {
+    range->buffer = acquire_buffer(range->pool);
+    range->base = range->position / DIRECT_BLOCK * DIRECT_BLOCK;
+    range->lead = range->fill = range->position - range->base;
+  }
+  *space = range->pool->size - range->fill;
+  return range->buffer + range->fill;
+}
+
+int copy_to_range_buffer(RangeBuffer *range, const char *data, size_t length) {
+  // Copy body bytes that were read elsewhere, e.g. with the header
+  while (length > 0) {
+    size_t space;
+    char *buffer = range_buffer_space(range, &space);
+    if (!buffer) {
+      return -1;
+    }
+    size_t copied = length < space ? length : space;
+    memcpy(buffer, data, copied);
+    range->fill += copied;
+    range->position += copied;
+    data += copied;
+    length -= copied;
+  }
+  return 0;
+}
 
+int open_connection(Scheduler *scheduler, const struct sockaddr_in *server,
+                    int *sock_out, SSL **ssl_out) {
   // Define the socket, AF_INET=IPv4, SOCK_STREAM=TCP
   int sock = socket(AF_INET, SOCK_STREAM, 0);
 
   // Check that the socket was created successfully
   if (sock < 0) {
-    printf("\nFailed to Create Socket\n");
-    return NULL;
+    perror("socket");
+    return -1;
   }
 
-  // Define struct for server address
-  struct sockaddr_in server;
-
-  // Define the server struct, htons() converts the default port for https to
-  // big-endian
-  server.sin_family = AF_INET;
-  server.sin_port = htons(443);
+  // Give up on connects, reads and writes that stall for longer than the
+  // timeout instead of hanging the thread
+  struct timeval tv = {.tv_sec = (long)scheduler->timeout,
+                       .tv_usec = (long)((scheduler->timeout -
+                                          (long)scheduler->timeout) *
+                                         1000000)};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  // Size the receive buffer for the bandwidth-delay product before connecting
+  // so the window scale is chosen for it, root may exceed rmem_max
+  if (scheduler->rcvbuf > 0 &&
+      setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &scheduler->rcvbuf,
+                 sizeof(scheduler->rcvbuf)) < 0) {
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &scheduler->rcvbuf,
+               sizeof(scheduler->rcvbuf));
+  }
 
-  // Cast the binary IP to a sockaddr_in struct and define sin_addr for the
-  // server
-  server.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+  // Select the congestion control algorithm of this connection
+  if (scheduler->congestion &&
+      setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, scheduler->congestion,
+                 strlen(scheduler->congestion)) < 0) {
+    perror("setsockopt TCP_CONGESTION");
+  }
 
   // Connect to server, convert the sockaddr_in -> sockaddr for generality
-  int conn = connect(sock, (struct sockaddr *)&server, sizeof(server));
-
-  // Check that the connection was successful
-  if (conn < 0) {
-    printf("\nConnection Failed\n");
-    return NULL;
+  if (connect(sock, (struct sockaddr *)server, sizeof(*server)) < 0) {
+    perror("connect");
+    close(sock);
+    return -1;
   }
 
-  // Initialize the SSL Configuration
-  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
-
-  // Create a new TLS session
-  SSL *ssl = SSL_new(ctx);
+  // Create a new TLS session from the shared configuration
+  SSL *ssl = SSL_new(scheduler->ctx);
 
   // Set the TLS SNI
-  SSL_set_tlsext_host_name(ssl, args->host);
+  SSL_set_tlsext_host_name(ssl, scheduler->host);
 
   // Bind the TLS session to the TCP socket
   SSL_set_fd(ssl, sock);
 
+  // Count the reads from the socket
+  BIO_set_callback_ex(SSL_get_rbio(ssl), count_socket_reads);
+  BIO_set_callback_arg(SSL_get_rbio(ssl), (char *)scheduler);
+
   // Connect the TLS session
-  SSL_connect(ssl);
+  if (SSL_connect(ssl) <= 0) {
+    fprintf(stderr, "\nTLS handshake failed\n");
+    ERR_print_errors_fp(stderr);
+    SSL_free(ssl);
+    close(sock);
+    return -1;
+  }
 
-  // Define a buffer to hold the output file string
-  char output[17];
+  *sock_out = sock;
+  *ssl_out = ssl;
+  return 0;
+}
+
+void set_receive_lowat(int sock, int *current, int lowat, long long left) {
+  // Never wait for more bytes than can still arrive, a TLS record that is
+  // already partly buffered may hold up to a record of what is left
+  if (left - TLS_RECORD_MAX < lowat) {
+    lowat = left - TLS_RECORD_MAX > 1 ? (int)(left - TLS_RECORD_MAX) : 1;
+  }
+  if (lowat != *current) {
+    setsockopt(sock, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+    *current = lowat;
+  }
+}
 
-  // Define the output string by appending the part number
-  sprintf(output, "part_%d", (args->part + 1));
+int read_response(SSL *ssl, int sock, int *current, int lowat,
+                  long long left, char *buffer, size_t size, size_t *bytes) {
+  // Block for the first bytes, then take whatever more the TLS session has
+  // already buffered so the buffer is written out in one piece. A partly
+  // buffered record still reads the socket, so the receive low watermark is
+  // kept within the bytes still to come before every read
+  if (lowat > 0) {
+    set_receive_lowat(sock, current, lowat, left);
+  }
+  if (!SSL_read_ex(ssl, buffer, size, bytes)) {
+    return SSL_get_error(ssl, 0);
+  }
+  size_t more;
+  while (*bytes < size && SSL_has_pending(ssl)) {
+    if (lowat > 0) {
+      set_receive_lowat(sock, current, lowat, left - (long long)*bytes);
+    }
+    if (!SSL_read_ex(ssl, buffer + *bytes, size - *bytes, &more)) {
+      break;
+    }
+    *bytes += more;
+  }
+  return SSL_ERROR_NONE;
+}
 
-  // Define and open the file for saving the image
-  FILE *fp = fopen(output, "wb");
+int range_download(Scheduler *scheduler, RangeTask *task,
+                   const struct sockaddr_in *server, long long *written) {
+  // Connect to the server, a failed connection is retried like a failed read
+  int sock;
+  SSL *ssl;
+  if (open_connection(scheduler, server, &sock, &ssl) < 0) {
+    return -1;
+  }
 
-  // Check that the file was opened/created successfully
-  if (!fp) {
-    perror("fopen");
-    return NULL;
+  // Make the range conditional on the object's validator, so a changed
+  // object is answered in full instead of with a range of another version
+  char condition[320] = "";
+  if (scheduler->if_range) {
+    snprintf(condition, sizeof(condition), "If-Range: %s\r\n",
+             scheduler->if_range);
   }
 
   // Define a buffer for the request
-  char request[1024];
+  char request[2048];
 
   // Define a GET request with ranging with the host, path, start and end bytes
   snprintf(request, sizeof(request),
@@ -118,80 +617,559 @@ void *range_download(void *arg) {
            "(X11; Linux x86_64) AppleWebKit/537.36 "
            "(KHTML, like Gecko) Chrome/140.0.0.0 "
            "Safari/537.36 Edg/140.0.0.0\r\n"
-           "Range: bytes=%d-%d\r\n"
+           "Range: bytes=%lld-%lld\r\n"
+           "%s"
            "Connection: close\r\n\r\n",
-           args->path, args->host, args->start, args->end);
+           scheduler->path, scheduler->host, task->start, task->end,
+           condition);
 
   // Print the HTTP Request defined above
-  printf("\nHTTP GET Request #%d\n---------\n%s", (args->part + 1), request);
+  printf("\nHTTP GET Request #%d\n---------\n%s", (task->part + 1), request);
+
+  // Define variables, buffer for the header, length of the header read so
+  // far, bytes of the body to skip, status of the result and the receive low
+  // watermark in use
+  char response[HEADER_MAX];
+  size_t header_len = 0;
+  int header_done = 0;
+  long long skip = 0;
+  long long length = task->end - task->start + 1;
+  int status = -1;
+  int lowat = 1;
+  size_t bytes;
+
+  // Define the pool buffer the body is read into, starting at the first byte
+  // of the range in the output file
+  RangeBuffer range = {.pool = scheduler->pool,
+                       .writer = scheduler->writer,
+                       .position = task->start};
 
   // Send the request
-  SSL_write(ssl, request, strlen(request));
+  if (SSL_write(ssl, request, strlen(request)) <= 0) {
+    fprintf(stderr, "\nFailed to send HTTP GET Request #%d\n", task->part + 1);
+    goto done;
+  }
 
-  // Define variables, buffer for response, flag for processing header, and
-  // bytes for length of response
-  char response[4096];
-  int header_done = 0;
-  int bytes;
+  // Read the response until the whole range has been received
+  while (range.position - task->start < length) {
+    long long left = length - (range.position - task->start);
+
+    // Read the header, and the body of a whole object before the range, into
+    // the header buffer, and the body straight into a pool buffer
+    char *data = response + header_len;
+    size_t space = HEADER_MAX - 1 - header_len;
+    if (header_done) {
+      data = skip > 0 ? response : range_buffer_space(&range, &space);
+      space = skip > 0 ? HEADER_MAX : space;
+    }
+    if (!data) {
+      status = -2;
+      goto done;
+    }
+
+    // Wake up only once enough bytes for a large read are queued, or read
+    // one small piece at a time on the plain read path
+    int error;
+    if (scheduler->plain_reads) {
+      int read = SSL_read(ssl, data, space < PLAIN_READ ? space : PLAIN_READ);
+      error = read > 0 ? SSL_ERROR_NONE : SSL_get_error(ssl, read);
+      bytes = read > 0 ? (size_t)read : 0;
+    } else {
+      error = read_response(ssl, sock, &lowat, scheduler->rcvlowat,
+                            skip + left, data, space, &bytes);
+    }
 
-  // Read 4096 bytes of the full response incrementally until it has been fully
-  // processed
-  while ((bytes = SSL_read(ssl, response, sizeof(response))) > 0) {
-    // Define modifiable variables to hold location of response and length of
-    // response
-    char *data = response;
-    int data_len = bytes;
+    // A clean close, a reset or a timeout before the range is complete all
+    // leave the rest of the range to a retry
+    if (error != SSL_ERROR_NONE) {
+      if (error == SSL_ERROR_ZERO_RETURN) {
+        fprintf(stderr, "\nPart %d: connection closed early\n",
+                task->part + 1);
+      } else {
+        fprintf(stderr, "\nPart %d: connection lost (SSL error %d)\n",
+                task->part + 1, error);
+        ERR_clear_error();
+      }
+      goto done;
+    }
+
+    // Define modifiable variable to hold the length of the response
+    size_t data_len = bytes;
+
+    // Count the body read into the pool buffer, never past the end of the
+    // range
+    if (header_done && data != response) {
+      bytes = (long long)bytes < left ? bytes : (size_t)left;
+      range.fill += bytes;
+      range.position += bytes;
+      continue;
+    }
 
     // Enter loop to process header if it has not been done yet
     if (!header_done) {
       // Find the end of header
+      header_len += bytes;
+      response[header_len] = '\0';
       char *body = strstr(response, "\r\n\r\n");
 
-      // If the end of the header has been found
-      if (body) {
-        // Find the content type in the header to only print the status
-        char *status = strcasestr(response, "content-type:");
+      // If the end of the header has not been found, keep reading it
+      if (!body) {
+        if (header_len >= HEADER_MAX - 1) {
+          fprintf(stderr, "\nPart %d: response header too long\n",
+                  task->part + 1);
+          status = -2;
+          goto done;
+        }
+        continue;
+      }
 
-        // Print status of the request
-        printf("\nHTTP GET Status #%d\n---------\n", (args->part + 1));
-        fwrite(response, 1, ((status - 2) - response), stdout);
-        printf("\n\n");
+      // Find the content type in the header to only print the status
+      char *content_type = strcasestr(response, "content-type:");
+
+      // Print status of the request
+      printf("\nHTTP GET Status #%d\n---------\n", (task->part + 1));
+      fwrite(response, 1,
+             content_type ? (content_type - 2) - response : body - response,
+             stdout);
+      printf("\n\n");
+
+      // A 206 holds the requested range, a 200 the whole object, where the
+      // bytes before the range are skipped, anything else is retried. With
+      // If-Range a 200 means the object changed since the HEAD request, and
+      // the ranges already written belong to another version
+      int code = 0;
+      sscanf(response, "HTTP/%*s %d", &code);
+      if ((code == 200 && scheduler->if_range) || code == 412) {
+        fprintf(stderr, "\nPart %d: the object changed during the download\n",
+                task->part + 1);
+        status = -2;
+        goto done;
+      } else if (code == 200) {
+        skip = task->start;
+      } else if (code != 206) {
+        fprintf(stderr, "\nPart %d: unexpected HTTP status %d\n",
+                task->part + 1, code);
+        status = code >= 400 && code < 500 ? -2 : -1;
+        goto done;
+      }
 
-        // Change data to point to the end of the header
-        data = body + 4;
+      // Change data to point to the end of the header
+      data = body + 4;
 
-        // Recalculate the length of the response without the header
-        data_len = bytes - (data - response);
+      // Recalculate the length of the response without the header
+      data_len = header_len - (data - response);
 
-        // Set header_done flag
-        header_done = 1;
-      }
-      // If the end of the header has not been found, restart the while loop
-      else {
-        continue;
-      }
+      // Set header_done flag
+      header_done = 1;
+    }
+
+    // Drop the part of a whole object before the range
+    if (skip > 0) {
+      size_t skipped = skip < (long long)data_len ? (size_t)skip : data_len;
+      skip -= skipped;
+      data += skipped;
+      data_len -= skipped;
     }
 
-    // Write the received binary data to the output location, not including
-    // header
-    fwrite(data, 1, data_len, fp);
+    // Copy the body that came with the header to the pool buffer, never
+    // past the end of the range
+    if ((long long)data_len > left) {
+      data_len = (size_t)left;
+    }
+    if (copy_to_range_buffer(&range, data, data_len) < 0) {
+      status = -2;
+      goto done;
+    }
   }
+  status = 0;
 
-  // Close the file once all the data has been received
-  fclose(fp);
+done:
+  // Hand what was received to the writer, the rest of the range is left to
+  // a retry that continues where it ends
+  if (flush_range_buffer(&range) < 0) {
+    status = -2;
+  }
+  *written = range.position - task->start;
 
   // Close the TLS session
   SSL_free(ssl);
 
-  // Release the TLS configuration object
-  SSL_CTX_free(ctx);
-
   // Close the Socket
   close(sock);
 
+  return status;
+}
+
+void *download_worker(void *arg) {
+  ThreadArguments *args = (ThreadArguments *)arg;
+  Scheduler *scheduler = args->scheduler;
+  unsigned int seed = (unsigned int)time(NULL) ^ (args->worker * 2654435761u);
+
+  pthread_mutex_lock(&scheduler->lock);
+  while (!scheduler->failed) {
+    // Wait for a range while other threads may still hand some back, and
+    // stop once every range is done
+    if (scheduler->queued == 0) {
+      if (scheduler->active == 0) {
+        break;
+      }
+      pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+      continue;
+    }
+
+    // Take the range that may be retried the soonest
+    int next = 0;
+    for (int i = 1; i < scheduler->queued; i++) {
+      if (scheduler->queue[i].not_before <
+          scheduler->queue[next].not_before) {
+        next = i;
+      }
+    }
+    RangeTask task = scheduler->queue[next];
+    scheduler->queue[next] = scheduler->queue[--scheduler->queued];
+    scheduler->active++;
+    pthread_mutex_unlock(&scheduler->lock);
+
+    // Wait out the backoff of a retried range
+    double wait = task.not_before - monotonic_seconds();
+    if (wait > 0) {
+      usleep((useconds_t)(wait * 1000000));
+    }
+
+    // Download the range, retries rotate through the server's addresses
+    const struct sockaddr_in *server =
+        &scheduler->servers[(task.part + task.attempts) %
+                            scheduler->server_count];
+    long long written = 0;
+    int status = range_download(scheduler, &task, server, &written);
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->active--;
+    scheduler->bytes += written;
+    if (status < 0) {
+      // Only the bytes that were not written go back to the queue, a range
+      // that made progress starts its backoff over
+      task.start += written;
+      task.attempts = written > 0 ? 1 : task.attempts + 1;
+      if (status == -2 || task.attempts > scheduler->max_retries) {
+        fprintf(stderr, "\nPart %d: giving up on bytes %lld-%lld\n",
+                task.part + 1, task.start, task.end);
+        scheduler->failed = 1;
+      } else {
+        task.not_before =
+            monotonic_seconds() + retry_delay(task.attempts, &seed);
+        fprintf(stderr, "\nPart %d: retrying bytes %lld-%lld in %.1f s\n",
+                task.part + 1, task.start, task.end,
+                task.not_before - monotonic_seconds());
+        scheduler->queue[scheduler->queued++] = task;
+      }
+    }
+    pthread_cond_broadcast(&scheduler->changed);
+  }
+  pthread_mutex_unlock(&scheduler->lock);
+
   return NULL;
 }
 
+void header_value(const char *header, const char *name, char *value,
+                  size_t size) {
+  // Find the "name:" line of the header and copy its value, or leave the
+  // value empty if there is no such line
+  value[0] = '\0';
+  const char *line = strcasestr(header, name);
+  while (line && line != header && line[-1] != '\n') {
+    line = strcasestr(line + 1, name);
+  }
+  if (!line) {
+    return;
+  }
+  line += strlen(name);
+  line += strspn(line, " \t");
+  snprintf(value, size, "%.*s", (int)strcspn(line, "\r\n"), line);
+}
+
+// Define the layout of the download cache, each URL has an entry named by the
+// SHA-256 of the URL that points to an object named by the SHA-256 of its
+// content, so identical objects behind different URLs are stored once
+#define CACHE_ENTRY_FORMAT "%s/%s.entry"
+#define CACHE_LOCK_FORMAT "%s/%s.lock"
+#define CACHE_OBJECT_FORMAT "%s/objects/%s"
+
+// Define a struct for the cache entry of a URL, the validators the server
+// sent with the object and the object's content hash
+typedef struct {
+  char etag[256];
+  char last_modified[64];
+  long long size;
+  char object[2 * SHA256_DIGEST_LENGTH + 1];
+} CacheEntry;
+
+void sha256_hex(const void *data, size_t length, char *hex) {
+  // Hash the data and write the digest as a hex string
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  EVP_Digest(data, length, digest, NULL, EVP_sha256(), NULL);
+  for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  }
+}
+
+int lock_cache_file(const char *path) {
+  // Open the lock file and wait for an exclusive lock on it, the lock is
+  // released by the kernel if the process dies
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+    perror("lock cache");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+int read_cache_entry(const char *path, CacheEntry *entry) {
+  // Read the fields of the entry, one "name value" line each
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+  memset(entry, 0, sizeof(*entry));
+  char line[512];
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *value = strchr(line, ' ');
+    if (!value) {
+      continue;
+    }
+    *value++ = '\0';
+    if (strcmp(line, "etag") == 0) {
+      snprintf(entry->etag, sizeof(entry->etag), "%s", value);
+    } else if (strcmp(line, "last-modified") == 0) {
+      snprintf(entry->last_modified, sizeof(entry->last_modified), "%s",
+               value);
+    } else if (strcmp(line, "size") == 0) {
+      entry->size = strtoll(value, NULL, 10);
+    } else if (strcmp(line, "object") == 0) {
+      snprintf(entry->object, sizeof(entry->object), "%s", value);
+    }
+  }
+  fclose(fp);
+
+  // An entry without an object or any validator cannot be used
+  return entry->object[0] && (entry->etag[0] || entry->last_modified[0])
+             ? 0
+             : -1;
+}
+
+int write_cache_entry(const char *path, const char *url,
+                      const CacheEntry *entry) {
+  // Write the entry to a temporary file and rename it over the old one, so
+  // readers see either the old or the new entry
+  char temp[PATH_MAX];
+  snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+  FILE *fp = fopen(temp, "w");
+  if (!fp) {
+    perror("fopen cache entry");
+    return -1;
+  }
+  fprintf(fp, "url %s\n", url);
+  if (entry->etag[0]) {
+    fprintf(fp, "etag %s\n", entry->etag);
+  }
+  if (entry->last_modified[0]) {
+    fprintf(fp, "last-modified %s\n", entry->last_modified);
+  }
+  fprintf(fp, "size %lld\nobject %s\n", entry->size, entry->object);
+  if (fclose(fp) != 0 || rename(temp, path) < 0) {
+    perror("write cache entry");
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+
+int materialize_file(const char *source, const char *dest) {
+  // Build the copy under a temporary name and rename it into place
+  char temp[PATH_MAX];
+  snprintf(temp, sizeof(temp), "%s.%d.tmp", dest, (int)getpid());
+  unlink(temp);
+
+  // Clone the file with a reflink, the copy is its own inode that shares
+  // the data blocks until either side is written
+  int in = open(source, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return -1;
+  }
+  int out = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (out < 0) {
+    close(in);
+    return -1;
+  }
+  int status = ioctl(out, FICLONE, in);
+
+  // Copy the data in the kernel where the filesystem cannot clone it, never
+  // hard link, so the output and the cache cannot change each other
+  if (status < 0) {
+    status = 0;
+    ssize_t copied;
+    while (status == 0 &&
+           (copied = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) != 0) {
+      status = copied < 0 ? -1 : 0;
+    }
+  }
+
+  // Copy through a buffer where the kernel cannot copy between the two
+  // files, e.g. across filesystems before Linux 5.3 and since 5.19, the file
+  // offsets continue where copy_file_range() stopped
+  if (status < 0 && (errno == EXDEV || errno == EOPNOTSUPP ||
+                     errno == ENOSYS || errno == EINVAL)) {
+    status = 0;
+    char buffer[1 << 16];
+    ssize_t length;
+    while (status == 0 && (length = read(in, buffer, sizeof(buffer))) != 0) {
+      status = length < 0 ? -1 : 0;
+      for (ssize_t done = 0; status == 0 && done < length;) {
+        ssize_t written = write(out, buffer + done, length - done);
+        status = written < 0 ? -1 : 0;
+        done += written;
+      }
+    }
+  }
+  close(in);
+  if (close(out) < 0) {
+    status = -1;
+  }
+
+  // Replace the destination with the finished copy
+  if (status < 0 || rename(temp, dest) < 0) {
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+
+// Define a struct for an entry seen while evicting, with its last use
+typedef struct {
+  char key[2 * SHA256_DIGEST_LENGTH + 1];
+  char object[2 * SHA256_DIGEST_LENGTH + 1];
+  long long size;
+  struct timespec used;
+  bool evicted;
+} CacheUse;
+
+int compare_cache_use(const void *a, const void *b) {
+  // Order the entries from the least to the most recently used
+  const struct timespec *x = &((const CacheUse *)a)->used;
+  const struct timespec *y = &((const CacheUse *)b)->used;
+  if (x->tv_sec != y->tv_sec) {
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  }
+  return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+void evict_cache(const char *cache_dir, long long max_bytes) {
+  // Collect every entry with the time it was last used, which is the
+  // modification time of its entry file
+  DIR *dir = opendir(cache_dir);
+  if (!dir) {
+    return;
+  }
+  CacheUse *uses = NULL;
+  int count = 0;
+  int capacity = 0;
+  struct dirent *file;
+  while ((file = readdir(dir))) {
+    char key[2 * SHA256_DIGEST_LENGTH + 1];
+    char path[PATH_MAX];
+    struct stat st;
+    CacheEntry entry;
+    if (strlen(file->d_name) != 2 * SHA256_DIGEST_LENGTH + 6 ||
+        strcmp(file->d_name + 2 * SHA256_DIGEST_LENGTH, ".entry") != 0) {
+      continue;
+    }
+    snprintf(key, sizeof(key), "%.64s", file->d_name);
+    snprintf(path, sizeof(path), CACHE_ENTRY_FORMAT, cache_dir, key);
+    if (stat(path, &st) < 0 || read_cache_entry(path, &entry) < 0) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity ? 2 * capacity : 64;
+      uses = realloc(uses, capacity * sizeof(CacheUse));
+    }
+    strcpy(uses[count].key, key);
+    strcpy(uses[count].object, entry.object);
+    uses[count].size = entry.size;
+    uses[count].used = st.st_mtim;
+    uses[count].evicted = false;
+    count++;
+  }
+  closedir(dir);
+
+  // Delete the objects no entry points to any more, e.g. old versions of an
+  // object that changed
+  char objects[PATH_MAX];
+  snprintf(objects, sizeof(objects), "%s/objects", cache_dir);
+  dir = opendir(objects);
+  while (dir && (file = readdir(dir))) {
+    bool used = strlen(file->d_name) != 2 * SHA256_DIGEST_LENGTH;
+    for (int i = 0; i < count && !used; i++) {
+      used = strcmp(uses[i].object, file->d_name) == 0;
+    }
+    if (!used) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), CACHE_OBJECT_FORMAT, cache_dir,
+               file->d_name);
+      unlink(path);
+    }
+  }
+  if (dir) {
+    closedir(dir);
+  }
+
+  // Add up the size of the distinct objects
+  qsort(uses, count, sizeof(CacheUse), compare_cache_use);
+  long long total = 0;
+  for (int i = 0; i < count; i++) {
+    bool shared = false;
+    for (int j = 0; j < i && !shared; j++) {
+      shared = strcmp(uses[j].object, uses[i].object) == 0;
+    }
+    total += shared ? 0 : uses[i].size;
+  }
+
+  // Remove the least recently used entries until the objects fit, skipping
+  // entries that another process holds the lock of, an object is deleted
+  // with the last entry that points to it
+  for (int i = 0; i < count && total > max_bytes; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), CACHE_LOCK_FORMAT, cache_dir, uses[i].key);
+    int lock = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB) < 0) {
+      if (lock >= 0) {
+        close(lock);
+      }
+      continue;
+    }
+    snprintf(path, sizeof(path), CACHE_ENTRY_FORMAT, cache_dir, uses[i].key);
+    unlink(path);
+    uses[i].evicted = true;
+    bool shared = false;
+    for (int j = 0; j < count && !shared; j++) {
+      shared = !uses[j].evicted && strcmp(uses[j].object, uses[i].object) == 0;
+    }
+    if (!shared) {
+      snprintf(path, sizeof(path), CACHE_OBJECT_FORMAT, cache_dir,
+               uses[i].object);
+      unlink(path);
+      total -= uses[i].size;
+      printf("Evicted %s (%lld bytes) from the cache\n", uses[i].object,
+             uses[i].size);
+    }
+    close(lock);
+  }
+  free(uses);
+}
+
 int main(int argc, char *argv[]) {
   // Define command-line arguments default values
   char *url =
@@ -199,6 +1177,16 @@ int main(int argc, char *argv[]) {
       "arxiv-logo-one-color-white.svg";
   int num_parts = 5;
   char *output = "image.jpg";
+  int max_retries = 5;
+  double timeout = 30;
+  int read_kb = 256;
+  int rcvbuf_kb = 0;
+  int lowat_kb = 0;
+  char *congestion = NULL;
+  char *cache_dir = NULL;
+  int pool_buffers = 0;
+  long long cache_mb = 10240;
+  int plain_reads = 0;
 
   // Parse passed arguments, if any
   for (int i = 1; i < argc; i++) {
@@ -208,13 +1196,97 @@ int main(int argc, char *argv[]) {
       num_parts = atoi(argv[++i]);
     } else if (strcmp(argv[i], "-o") == 0) {
       output = argv[++i];
+    } else if (strcmp(argv[i], "-r") == 0) {
+      max_retries = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-t") == 0) {
+      timeout = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-b") == 0) {
+      read_kb = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      rcvbuf_kb = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-l") == 0) {
+      lowat_kb = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0) {
+      congestion = argv[++i];
+    } else if (strcmp(argv[i], "-q") == 0) {
+      pool_buffers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-C") == 0) {
+      cache_dir = argv[++i];
+    } else if (strcmp(argv[i], "-M") == 0) {
+      cache_mb = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "-a") == 0) {
+      plain_reads = 1;
     }
   }
 
+  // A write to a connection the server has reset fails with EPIPE and is
+  // retried instead of ending the program
+  signal(SIGPIPE, SIG_IGN);
+
   // Print Arguments
   printf("\nArguments\n----------\nURL: %s\n", url);
   printf("Number of Parts: %d\n", num_parts);
   printf("Output: %s\n", output);
+  printf("Retries: %d\n", max_retries);
+  printf("Timeout: %g s\n", timeout);
+  printf("Read Size: %d KB%s\n", read_kb,
+         plain_reads ? ", plain 4 KB reads without read-ahead" : "");
+  printf("Receive Buffer: %d KB\n", rcvbuf_kb);
+  printf("Receive Low Watermark: %d KB\n", lowat_kb);
+  printf("Congestion Control: %s\n", congestion ? congestion : "default");
+  printf("Cache: %s\n", cache_dir ? cache_dir : "none");
+
+  // Give every thread a buffer to fill and one more waiting to be written by
+  // default
+  if (pool_buffers == 0) {
+    pool_buffers = 2 * num_parts;
+  }
+  printf("Buffer Pool: %d x %d KB\n", pool_buffers, read_kb);
+
+  // Check the arguments
+  if (num_parts < 1 || max_retries < 0 || timeout <= 0) {
+    fprintf(stderr, "\nNUM_PARTS and TIMEOUT must be positive and RETRIES "
+                    "not negative\n");
+    return -1;
+  }
+  if (read_kb < 1 || pool_buffers < 1 || rcvbuf_kb < 0 || lowat_kb < 0 ||
+      cache_mb < 0 || read_kb > 1024 * 1024 || rcvbuf_kb > 1024 * 1024 ||
+      lowat_kb > 1024 * 1024) {
+    fprintf(stderr, "\nREAD_KB and POOL_BUFFERS must be positive, RCVBUF_KB, "
+                    "LOWAT_KB and CACHE_MB not negative and the buffers at "
+                    "most 1 GB\n");
+    return -1;
+  }
+
+  // Open the cache entry of the URL if "-C" specified, holding its lock until
+  // the download is done so other processes fetching the same URL wait for
+  // it and then revalidate the result
+  int cache_lock = -1;
+  char cache_key[2 * SHA256_DIGEST_LENGTH + 1];
+  char entry_path[PATH_MAX];
+  char object_path[PATH_MAX];
+  CacheEntry cached;
+  bool have_cached = false;
+  if (cache_dir) {
+    snprintf(object_path, sizeof(object_path), "%s/objects", cache_dir);
+    mkdir(cache_dir, 0755);
+    mkdir(object_path, 0755);
+    sha256_hex(url, strlen(url), cache_key);
+    char lock_path[PATH_MAX];
+    snprintf(lock_path, sizeof(lock_path), CACHE_LOCK_FORMAT, cache_dir,
+             cache_key);
+    cache_lock = lock_cache_file(lock_path);
+    if (cache_lock < 0) {
+      return -1;
+    }
+    snprintf(entry_path, sizeof(entry_path), CACHE_ENTRY_FORMAT, cache_dir,
+             cache_key);
+    if (read_cache_entry(entry_path, &cached) == 0) {
+      snprintf(object_path, sizeof(object_path), CACHE_OBJECT_FORMAT,
+               cache_dir, cached.object);
+      have_cached = access(object_path, R_OK) == 0;
+    }
+  }
 
   // // Make a writable copy of the URL
   char *url_copy = strdup(url);
@@ -274,52 +1346,65 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
-  // Define the socket, AF_INET=IPv4, SOCK_STREAM=TCP
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
-
-  // Check that the socket was created successfully
-  if (sock < 0) {
-    printf("\nFailed to Create Socket\n");
-    return -1;
+  // Define the shared download state, keeping every address of the server so
+  // retries can move to another one
+  Scheduler scheduler = {.host = host,
+                         .path = path,
+                         .max_retries = max_retries,
+                         .timeout = timeout,
+                         .rcvbuf = rcvbuf_kb * 1024,
+                         .rcvlowat = lowat_kb * 1024,
+                         .congestion = congestion,
+                         .lock = PTHREAD_MUTEX_INITIALIZER,
+                         .changed = PTHREAD_COND_INITIALIZER};
+  for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+    scheduler.server_count++;
+  }
+  scheduler.servers =
+      calloc(scheduler.server_count, sizeof(struct sockaddr_in));
+  scheduler.server_count = 0;
+  for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+    // Define the server struct, htons() converts the default port for https
+    // to big-endian
+    struct sockaddr_in *server = &scheduler.servers[scheduler.server_count++];
+    *server = *(struct sockaddr_in *)ai->ai_addr;
+    server->sin_port = htons(443);
+  }
+  freeaddrinfo(res);
+
+  // Initialize the SSL Configuration, shared by all connections. With read
+  // ahead, a read from the socket takes as many TLS records as fit in the read
+  // buffer instead of one record header and body at a time, the plain read
+  // path of "-a" keeps OpenSSL's defaults
+  scheduler.ctx = SSL_CTX_new(TLS_client_method());
+  scheduler.plain_reads = plain_reads;
+  if (!plain_reads) {
+    SSL_CTX_set_read_ahead(scheduler.ctx, 1);
+    SSL_CTX_set_default_read_buffer_len(scheduler.ctx,
+                                        (size_t)read_kb * 1024);
   }
 
-  // Define struct for server address
-  struct sockaddr_in server;
-
-  // Define the server struct, htons() converts the default port for https to
-  // big-endian
-  server.sin_family = AF_INET;
-  server.sin_port = htons(443);
-
-  // Cast the binary IP to a sockaddr_in struct and define sin_addr
-  server.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
-
-  // Connect to server, convert the sockaddr_in -> sockaddr for generality
-  int conn = connect(sock, (struct sockaddr *)&server, sizeof(server));
-
-  // Check that the connection was successful
-  if (conn < 0) {
+  // Connect to the server for the HEAD request
+  int sock;
+  SSL *ssl;
+  if (open_connection(&scheduler, &scheduler.servers[0], &sock, &ssl) < 0) {
     printf("\nConnection Failed\n");
     return -1;
   }
 
-  // Initialize the SSL Configuration
-  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
-
-  // Create a new TLS session
-  SSL *ssl = SSL_new(ctx);
-
-  // Set the TLS SNI
-  SSL_set_tlsext_host_name(ssl, host);
-
-  // Bind the TLS session to the TCP socket
-  SSL_set_fd(ssl, sock);
-
-  // Connect the TLS session
-  SSL_connect(ssl);
+  // Make the request conditional on the validators of the cached object, so
+  // the server answers 304 if it has not changed
+  char conditions[512] = "";
+  if (have_cached && cached.etag[0]) {
+    snprintf(conditions, sizeof(conditions), "If-None-Match: %s\r\n",
+             cached.etag);
+  } else if (have_cached) {
+    snprintf(conditions, sizeof(conditions), "If-Modified-Since: %s\r\n",
+             cached.last_modified);
+  }
 
   // Define a buffer for the request
-  char request[1024];
+  char request[2048];
 
   // Define a HEAD request with the host and path
   snprintf(request, sizeof(request),
@@ -330,8 +1415,9 @@ int main(int argc, char *argv[]) {
            "(KHTML, like Gecko) Chrome/140.0.0.0 "
            "Safari/537.36 Edg/140.0.0.0\r\n"
            // "Accept: */*\r\n"
+           "%s"
            "Connection: close\r\n\r\n",
-           path, host);
+           path, host, conditions);
 
   // Print the HTTP Request defined above
   printf("\nHTTP Head Request\n----------\n%s", request);
@@ -339,61 +1425,74 @@ int main(int argc, char *argv[]) {
   // Send the request
   SSL_write(ssl, request, strlen(request));
 
-  // Define variables, buffer for response, bytes for length of response, and
-  // file_size for returned file size
-  char response[4096];
+  // Define variables, buffer for response, length of the response, and
+  // bytes for length of each read
+  char response[HEADER_MAX];
+  int response_len = 0;
   int bytes;
-  int file_size = 0;
-
-  // Read 4096 bytes of the full response incrementally until it has been fully
-  // processed
-  while ((bytes = SSL_read(ssl, response, sizeof(response))) > 0) {
-    // Print the received header to the terminal
-    printf("HTTP Head Response\n----------\n");
-    fwrite(response, 1, bytes, stdout);
-
-    // // Make a writable copy of the response
-    char *response_copy = strdup(response);
-
-    // Find content length in the copy of the response
-    char *content_length = strcasestr(response_copy, "content-length:");
-
-    // If content_length is found in the response
-    if (content_length) {
-      // Add 16 to point to the first integer of content length label
-      content_length += 16;
-
-      // Find date in the response
-      char *date = strstr(content_length, "date");
-
-      // If date is found
-      if (date) {
-        // Subtract 2 to point to the last integer of content-length
-        date -= 2;
-        // Add a null terminator after the last integer so the content_length
-        // string only has the file size
-        *date = '\0';
-      }
 
-      // Convert the file length extracted from the header to an integer
-      file_size = atoi(content_length);
-    }
+  // Read the full response incrementally until it has been fully processed
+  while ((bytes = SSL_read(ssl, response + response_len,
+                           sizeof(response) - 1 - response_len)) > 0) {
+    response_len += bytes;
   }
+  response[response_len] = '\0';
+
+  // Print the received header to the terminal
+  printf("HTTP Head Response\n----------\n%s", response);
 
   // Close the TLS session
   SSL_free(ssl);
 
-  // Release the TLS configuration object
-  SSL_CTX_free(ctx);
-
   // Close the Socket
   close(sock);
 
+  // Find the status, the content length and the validators in the response
+  int code = 0;
+  char value[256];
+  CacheEntry fetched = {0};
+  sscanf(response, "HTTP/%*s %d", &code);
+  header_value(response, "content-length:", value, sizeof(value));
+  long long file_size = strtoll(value, NULL, 10);
+  header_value(response, "etag:", fetched.etag, sizeof(fetched.etag));
+  header_value(response, "last-modified:", fetched.last_modified,
+               sizeof(fetched.last_modified));
+
+  // If the cached object is still current, clone or copy it to the output
+  // instead of downloading it again, and mark the entry as just used
+  if (code == 304 && have_cached) {
+    if (materialize_file(object_path, output) == 0) {
+      utimensat(AT_FDCWD, entry_path, NULL, 0);
+      printf("\nNot modified, %s was taken from the cache\n", output);
+      close(cache_lock);
+      return 0;
+    }
+
+    // Download the object again if the cached copy is gone
+    perror("materialize cached object");
+    file_size = cached.size;
+    fetched = cached;
+  }
+
+  // Pin every range to the version the HEAD request saw, by its strong ETag,
+  // or by its modification date since weak ETags are not allowed in If-Range
+  if (fetched.etag[0] && strncmp(fetched.etag, "W/", 2) != 0) {
+    scheduler.if_range = fetched.etag;
+  } else if (fetched.last_modified[0]) {
+    scheduler.if_range = fetched.last_modified;
+  }
+
+  // Check that there is something to download
+  if (file_size <= 0) {
+    fprintf(stderr, "\nThe server did not report the object's size\n");
+    return -1;
+  }
+
   // Calculate the size of download for each thread
-  int part_size = file_size / num_parts;
+  long long part_size = file_size / num_parts;
 
   // Calculate the remainder of the file size
-  int remainder = file_size - (part_size * num_parts);
+  long long remainder = file_size - (part_size * num_parts);
 
   // Define number of threads equal to num_parts
   pthread_t threads[num_parts];
@@ -401,16 +1500,19 @@ int main(int argc, char *argv[]) {
   // Define ThreadArguments structs equal to num_parts
   ThreadArguments args[num_parts];
 
+  // Define the queue of ranges, there is never more than one per part
+  scheduler.queue = calloc(num_parts, sizeof(RangeTask));
+
   // Define variable for loop to store previous end byte
-  int prev_end = 0;
+  long long prev_end = 0;
 
   // Loop for num_parts
   for (int i = 0; i < num_parts; i++) {
     // Calculate the first byte by assigning the previous end byte
-    int start = prev_end;
+    long long start = prev_end;
 
     // Calculate the end byte by adding the part size to the start byte
-    int end = start + part_size - 1;
+    long long end = start + part_size - 1;
 
     // If it is the last part, add the remainder as well to the end byte
     if (i == (num_parts - 1)) {
@@ -421,15 +1523,44 @@ int main(int argc, char *argv[]) {
     // it starts at the next byte
     prev_end = end + 1;
 
-    // Fill the values of the struct to pass multiple arguments to thread
-    args[i].part = i;
-    args[i].host = host;
-    args[i].path = path;
-    args[i].start = start;
-    args[i].end = end;
+    // Queue the range of the part, empty parts of tiny objects are skipped
+    if (end >= start) {
+      scheduler.queue[scheduler.queued++] =
+          (RangeTask){.part = i, .start = start, .end = end};
+    }
+  }
 
-    // Create a thread for the current loop and args for range download
-    pthread_create(&threads[i], NULL, range_download, &args[i]);
+  // Define the pool of read buffers, enough for every thread to fill one
+  // while the writer writes out the rest
+  BufferPool pool;
+  if (create_buffer_pool(&pool, pool_buffers, (size_t)read_kb * 1024) < 0) {
+    return -1;
+  }
+  scheduler.pool = &pool;
+
+  // Write the ranges straight into a temporary file next to the output at
+  // their offsets, and rename it over the output once it is complete
+  char download_path[PATH_MAX];
+  snprintf(download_path, sizeof(download_path), "%s.download", output);
+  FileWriter writer;
+  if (open_file_writer(&writer, download_path, file_size, &pool) < 0) {
+    return -1;
+  }
+  scheduler.writer = &writer;
+
+  // Note the time and CPU use before the download
+  double download_start = monotonic_seconds();
+  long long head_reads = scheduler.socket_reads;
+  long long syscalls_start = read_syscalls();
+  struct rusage usage_start;
+  getrusage(RUSAGE_SELF, &usage_start);
+
+  // Create one thread per part, each downloads ranges from the queue until
+  // every range is done
+  for (int i = 0; i < num_parts; i++) {
+    args[i].worker = i;
+    args[i].scheduler = &scheduler;
+    pthread_create(&threads[i], NULL, download_worker, &args[i]);
   }
 
   // Join the threads above
@@ -437,47 +1568,84 @@ int main(int argc, char *argv[]) {
     pthread_join(threads[i], NULL);
   }
 
-  // Open the output file for writing
-  FILE *fp = fopen(output, "wb");
+  // Print the throughput, and the read system calls, the reads of the TLS
+  // sessions from their socket BIOs and the CPU time per GB
+  double elapsed = monotonic_seconds() - download_start;
+  long long syscalls = read_syscalls() - syscalls_start;
+  struct rusage usage_end;
+  getrusage(RUSAGE_SELF, &usage_end);
+  double cpu = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+               (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+               (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec +
+                usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) /
+                   1e6;
+  double gigabytes = scheduler.bytes > 0 ? scheduler.bytes / 1e9 : 1;
+  printf("\nDownloaded %lld bytes in %.3f s (%.1f MB/s), %.0f read syscalls, "
+         "%.0f socket BIO reads and %.3f s CPU per GB\n",
+         scheduler.bytes, elapsed, scheduler.bytes / elapsed / 1e6,
+         syscalls_start < 0 ? -1.0 : syscalls / gigabytes,
+         (scheduler.socket_reads - head_reads) / gigabytes, cpu / gigabytes);
+
+  // Wait until everything received is on the disk
+  if (close_file_writer(&writer) < 0) {
+    scheduler.failed = 1;
+  }
 
-  // Check that the output file was opened successfully
-  if (!fp) {
-    perror("fopen output_file");
+  // Release the TLS configuration object
+  SSL_CTX_free(scheduler.ctx);
+  free(scheduler.servers);
+  free(scheduler.queue);
+
+  // Do not replace the output with a truncated file if a range could not be
+  // downloaded or written
+  if (scheduler.failed) {
+    fprintf(stderr, "\nDownload failed, %s was not written\n", output);
+    unlink(download_path);
     return -1;
   }
 
-  // Loop for num_parts
-  for (int i = 0; i < num_parts; i++) {
-    // Define the output string by appending the part number
-    char file[17];
-    sprintf(file, "part_%d", (i + 1));
-
-    // Open one of the thread output files for reading
-    FILE *in_fp = fopen(file, "rb");
+  // Move the download into place, replacing the old output rather than
+  // writing into it since it may be a hard link to a cached object
+  if (rename(download_path, output) < 0) {
+    perror("rename output file");
+    return -1;
+  }
 
-    // Check that the current thread output file was opened successfully
-    if (!in_fp) {
-      perror("fopen input file");
-      continue;
+  // Store the object in the cache under its content hash, unless the server
+  // sent nothing to revalidate it with, and record its validators
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  if (cache_dir && (fetched.etag[0] || fetched.last_modified[0]) &&
+      hash_file(output, &pool, hash) == 0) {
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+      sprintf(fetched.object + 2 * i, "%02x", hash[i]);
     }
-
-    // Define variables, buffer for holding read info, and bytes for size of
-    // file
-    char buffer[4096];
-    size_t bytes;
-
-    // Read the current thread output file until finished
-    while ((bytes = fread(buffer, 1, sizeof(buffer), in_fp)) > 0) {
-      // Write the read info to the overall output file
-      fwrite(buffer, 1, bytes, fp);
+    fetched.size = file_size;
+    snprintf(object_path, sizeof(object_path), CACHE_OBJECT_FORMAT, cache_dir,
+             fetched.object);
+
+    // Store the object and its entry, then evict the least recently used
+    // objects, while holding the lock of the whole cache
+    char lock_path[PATH_MAX];
+    snprintf(lock_path, sizeof(lock_path), "%s/cache.lock", cache_dir);
+    int store_lock = lock_cache_file(lock_path);
+    if (store_lock >= 0) {
+      // Objects are read-only copies, separate from the output
+      if (access(object_path, R_OK) == 0 ||
+          (materialize_file(output, object_path) == 0 &&
+           chmod(object_path, 0444) == 0)) {
+        write_cache_entry(entry_path, url, &fetched);
+      } else {
+        perror("store cached object");
+      }
+      evict_cache(cache_dir, cache_mb * 1024 * 1024);
+      close(store_lock);
     }
-
-    // Close the current thread output file
-    fclose(in_fp);
   }
-
-  // Close the overall output file
-  fclose(fp);
+  if (cache_lock >= 0) {
+    close(cache_lock);
+  }
+  free(pool.memory);
+  free(pool.free);
 
   return 0;
 }
@@ -0,0 +1,135 @@
+import ssl
+from re import search
+from os import urandom
+from subprocess import run
+from threading import Thread
+from tempfile import TemporaryDirectory
+from argparse import ArgumentParser
+from os.path import abspath, dirname, getsize, join
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class RangeHandler(BaseHTTPRequestHandler):
+    # Serve one file with HEAD and ranged GET requests over HTTP/1.1
+    protocol_version = "HTTP/1.1"
+    path_on_disk = None
+
+    def log_message(self, *args):
+        pass
+
+    def send_headers(self, code, length, start=None, end=None, size=None):
+        self.send_response(code)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(length))
+        if start is not None:
+            self.send_header("Content-Range", f"bytes {start}-{end}/{size}")
+        self.end_headers()
+
+    def do_HEAD(self):
+        self.send_headers(200, getsize(self.path_on_disk))
+
+    def do_GET(self):
+        # Answer the requested range, or the whole file without one
+        size = getsize(self.path_on_disk)
+        match = search(r"bytes=(\d+)-(\d+)", self.headers.get("Range", ""))
+        if match:
+            start, end = int(match.group(1)), min(int(match.group(2)), size - 1)
+            self.send_headers(206, end - start + 1, start, end, size)
+        else:
+            start, end = 0, size - 1
+            self.send_headers(200, size)
+
+        # Send the range in large writes so the server is not the bottleneck
+        with open(self.path_on_disk, "rb") as f:
+            f.seek(start)
+            left = end - start + 1
+            while left > 0:
+                data = f.read(min(1 << 20, left))
+                self.wfile.write(data)
+                left -= len(data)
+
+
+def serve(directory, path):
+    # Start an HTTPS server on port 443 with a throwaway self-signed certificate
+    cert, key = join(directory, "cert.pem"), join(directory, "key.pem")
+    run(
+        ["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-keyout", key, "-out", cert,
+         "-days", "1", "-subj", "/CN=localhost"],
+        capture_output=True,
+        check=True,
+    )
+    RangeHandler.path_on_disk = path
+    server = ThreadingHTTPServer(("127.0.0.1", 443), RangeHandler)
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(cert, key)
+    server.socket = context.wrap_socket(server.socket, server_side=True)
+    Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+def download(binary, directory, num_parts, profile):
+    # Run http_downloader and parse its summary line
+    output = join(directory, "output.bin")
+    result = run(
+        [binary, "-u", "https://localhost/object.bin", "-n", f"{num_parts}", "-o", output] + profile.split(),
+        capture_output=True,
+        text=True,
+        cwd=directory,
+    )
+    match = search(
+        r"in ([\d.]+) s \(([\d.]+) MB/s\), (-?\d+) read syscalls, (\d+) socket BIO reads and ([\d.]+) s CPU",
+        result.stdout,
+    )
+    if result.returncode != 0 or not match:
+        raise SystemExit(f"http_downloader failed: {result.stderr.strip()}")
+    return [float(value) for value in match.groups()]
+
+
+def main():
+    # Define arguments
+    desc = "Benchmark the read path of http_downloader against a local HTTPS server"
+    parser = ArgumentParser(description=desc)
+    parser.add_argument("-n", dest="num_runs", default="3", help="Number of downloads per profile")
+    parser.add_argument("-p", dest="num_parts", default="4", help="Number of parallel connections")
+    parser.add_argument("--size", dest="size", default="512", help="Size of the test object in MB")
+    parser.add_argument(
+        "--profile",
+        dest="profiles",
+        action="append",
+        help="Extra http_downloader arguments of a profile to compare, may be repeated",
+    )
+    parser.add_argument(
+        "--binary",
+        dest="binary",
+        default=join(dirname(dirname(abspath(__file__))), "http_downloader"),
+        help="Path to the http_downloader binary",
+    )
+
+    # Assign arguments to variables, the default profiles are the old plain 4 KB reads
+    # without read-ahead, the default read path and the high-throughput profile
+    args = parser.parse_args()
+    num_runs = int(args.num_runs)
+    profiles = args.profiles or ["-a", "", "-b 1024 -s 16384 -l 256 -c bbr"]
+
+    with TemporaryDirectory() as directory:
+        # Write the test object and serve it
+        path = join(directory, "object.bin")
+        with open(path, "wb") as f:
+            for _ in range(int(args.size)):
+                f.write(urandom(1 << 20))
+        server = serve(directory, path)
+
+        # Download the object num_runs times per profile and average the results
+        print(f"{'profile':<36}{'MB/s':>10}{'syscalls/GB':>13}{'BIO reads/GB':>14}{'CPU s/GB':>10}")
+        for profile in profiles:
+            results = [download(args.binary, directory, args.num_parts, profile) for _ in range(num_runs)]
+            averages = [sum(values) / num_runs for values in zip(*results)]
+            print(
+                f"{profile or '(defaults)':<36}{averages[1]:>10.1f}{averages[2]:>13.0f}{averages[3]:>14.0f}"
+                f"{averages[4]:>10.3f}"
+            )
+        server.shutdown()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,97 @@
+from json import load, loads
+from time import monotonic
+from subprocess import run
+from argparse import ArgumentParser
+from os.path import abspath, dirname, join
+
+
+def traceroute(binary, args):
+    # Run tcp_traceroute in the prober namespace and time it
+    start = monotonic()
+    result = run(["ip", "netns", "exec", "tr0", binary] + args, capture_output=True, text=True)
+    elapsed = monotonic() - start
+    if result.returncode != 0:
+        raise SystemExit(f"tcp_traceroute failed: {result.stderr.strip()}")
+    return elapsed
+
+
+def count_probes(binary, log):
+    # Count the probe records of a binary trace log
+    result = run([binary, "-R", log, "-j"], capture_output=True, text=True, check=True)
+    return sum(1 for line in result.stdout.splitlines() if loads(line)["kind"] == "probe")
+
+
+def main():
+    # Define arguments
+    desc = "Benchmark tcp_traceroute on a chain of network namespaces"
+    parser = ArgumentParser(description=desc)
+    parser.add_argument("-n", dest="num_runs", default="10", help="Number of traces towards the target")
+    parser.add_argument("--hops", dest="hops", default="4", help="Number of hops to the target")
+    parser.add_argument("--delay", dest="delay", default="5", help="Delay in ms per link and direction")
+    parser.add_argument("--loss", dest="loss", default="0", help="Loss in percent per link and direction")
+    parser.add_argument("-T", dest="targets", default="4096", help="Number of targets of the multi-target benchmark")
+    parser.add_argument("-r", dest="rate", default="100000", help="Probe rate of the multi-target benchmark")
+    parser.add_argument("--keep", action="store_true", help="Leave the namespaces up afterwards")
+    parser.add_argument(
+        "--binary",
+        dest="binary",
+        default=join(dirname(dirname(abspath(__file__))), "tcp_traceroute"),
+        help="Path to the tcp_traceroute binary",
+    )
+
+    # Assign arguments to variables
+    args = parser.parse_args()
+    num_runs = int(args.num_runs)
+    hops = int(args.hops)
+    binary = args.binary
+    topology = join(dirname(abspath(__file__)), "netns_topology.sh")
+    target = f"10.200.{hops}.2"
+
+    # Build the chain, netem may be missing in which case the links add nothing
+    result = run([topology, "up", args.hops, args.delay, args.loss], capture_output=True, text=True, check=True)
+    print(result.stderr + result.stdout, end="")
+    netem = "not available" not in result.stderr
+    delay = float(args.delay) if netem else 0.0
+
+    try:
+        # Trace the target num_runs times and collect the per-hop stats
+        elapsed = traceroute(
+            binary,
+            ["-t", target, "-m", f"{hops + 2}", "-n", f"{num_runs}", "-o", "/tmp/bench_stats.json", "-L", "/tmp/bench.log"],
+        )
+        probes = count_probes(binary, "/tmp/bench.log")
+        with open("/tmp/bench_stats.json") as json_file:
+            stats = load(json_file)
+
+        print(f"\nclassic mode, {num_runs} runs towards {target}")
+        print(f"trace time   {1000 * elapsed / num_runs:10.3f} ms per run")
+        print(f"probe rate   {probes / elapsed:10.1f} probes/sec")
+
+        # Each hop is one link further away, crossed twice per RTT
+        print(f"\n{'hop':>3}  {'expected':>9} {'min':>9} {'med':>9} {'p95':>9} {'max':>9} {'error':>9} {'loss%':>6}")
+        for hop in stats:
+            expected = 2 * hop["hop"] * delay
+            print(
+                f"{hop['hop']:3d}  {expected:9.3f} {hop['min']:9.3f} {hop['med']:9.3f} {hop['p95']:9.3f} "
+                f"{hop['max']:9.3f} {hop['med'] - expected:9.3f} {100 * hop['loss']:6.1f}"
+            )
+
+        # Trace many addresses of the target at once for the send rate
+        with open("/tmp/bench_targets.txt", "w") as f:
+            for i in range(int(args.targets)):
+                print(f"10.201.{i // 256}.{i % 256}", file=f)
+        elapsed = traceroute(
+            binary,
+            ["-T", "/tmp/bench_targets.txt", "-m", f"{hops + 2}", "-r", args.rate, "-L", "/tmp/bench.log"],
+        )
+        probes = count_probes(binary, "/tmp/bench.log")
+        print(f"\nmulti-target mode, {args.targets} targets at up to {args.rate} probes/sec")
+        print(f"trace time   {1000 * elapsed:10.3f} ms")
+        print(f"probe rate   {probes / elapsed:10.1f} probes/sec")
+    finally:
+        if not args.keep:
+            run([topology, "down"], check=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,123 @@
+#!/bin/bash
+# Build or remove a chain of network namespaces to run tcp_traceroute against
+# offline. tr0 is the prober, tr1 .. tr(HOPS-1) are routers and trHOPS is the
+# target at 10.200.HOPS.2, so the target is HOPS hops away. Link i joins
+# tr(i-1) (10.200.i.1) and tr(i) (10.200.i.2), and netem adds DELAY_MS of delay
+# and LOSS_PCT of loss in each direction of every link. The target listens on
+# port 80 (SYN-ACK) and answers every other port with a RST. Every address of
+# 10.201.0.0/16 is also local to the target, for multi-target runs.
+#
+# usage: sudo ./netns_topology.sh up [HOPS] [DELAY_MS] [LOSS_PCT]
+#        sudo ./netns_topology.sh down
+
+set -e
+
+PREFIX=tr
+LISTEN_PORT=80
+
+down() {
+  # Stop whatever runs in the namespaces, then delete them with their links
+  for ns in $(ip netns list | awk '{print $1}' | grep -E "^${PREFIX}[0-9]+$"); do
+    ip netns pids "$ns" | xargs -r kill 2>/dev/null || true
+    ip netns del "$ns"
+  done
+}
+
+up() {
+  local hops=${1:-4} delay=${2:-5} loss=${3:-0}
+
+  if [ "$hops" -lt 1 ] || [ "$hops" -gt 250 ]; then
+    echo "HOPS must be between 1 and 250" >&2
+    exit 1
+  fi
+
+  down
+
+  # Create the namespaces, every one but the prober forwards and answers with
+  # ICMP errors as fast as it is asked to
+  for i in $(seq 0 "$hops"); do
+    ip netns add "$PREFIX$i"
+    ip -n "$PREFIX$i" link set lo up
+    ip netns exec "$PREFIX$i" sysctl -qw net.ipv4.ip_forward=1
+    ip netns exec "$PREFIX$i" sysctl -qw net.ipv4.icmp_ratelimit=0
+    ip netns exec "$PREFIX$i" sysctl -qw net.ipv4.icmp_msgs_per_sec=1000000
+    ip netns exec "$PREFIX$i" sysctl -qw net.ipv4.icmp_msgs_burst=1000000
+  done
+
+  # Unreachables are also limited per route, that limit is only settable
+  # host-wide
+  sysctl -qw net.ipv4.route.error_cost=0 2>/dev/null || true
+  sysctl -qw net.ipv4.route.error_burst=1000000 2>/dev/null || true
+
+  # Join neighbours with veth pairs, one /24 per link
+  local netem=1
+  for i in $(seq 1 "$hops"); do
+    local left="$PREFIX$((i - 1))" right="$PREFIX$i"
+    ip link add "v${i}l" netns "$left" type veth peer name "v${i}r" netns "$right"
+    ip -n "$left" addr add "10.200.$i.1/24" dev "v${i}l"
+    ip -n "$right" addr add "10.200.$i.2/24" dev "v${i}r"
+    ip -n "$left" link set "v${i}l" up
+    ip -n "$right" link set "v${i}r" up
+
+    # Delay and drop packets in both directions, links stay usable without
+    # netem
+    if [ "$delay" != 0 ] || [ "$loss" != 0 ]; then
+      if ! ip netns exec "$left" tc qdisc add dev "v${i}l" root netem \
+          delay "${delay}ms" loss "${loss}%" 2>/dev/null ||
+         ! ip netns exec "$right" tc qdisc add dev "v${i}r" root netem \
+          delay "${delay}ms" loss "${loss}%" 2>/dev/null; then
+        netem=0
+      fi
+    fi
+  done
+
+  # Route towards the target through the next namespace and back towards the
+  # prober through the previous one
+  ip -n "${PREFIX}0" route add default via 10.200.1.2
+  for i in $(seq 1 "$hops"); do
+    if [ "$i" -lt "$hops" ]; then
+      ip -n "$PREFIX$i" route add default via "10.200.$((i + 1)).2"
+    fi
+    for j in $(seq 1 $((i - 1))); do
+      ip -n "$PREFIX$i" route add "10.200.$j.0/24" via "10.200.$i.1"
+    done
+  done
+
+  # Answer for a whole /16 at the target
+  ip -n "$PREFIX$hops" route add local 10.201.0.0/16 dev lo
+
+  # Accept connections on LISTEN_PORT at the target, the kernel sends a RST
+  # for every other port
+  ip netns exec "$PREFIX$hops" python3 -c "
+import socket, time
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('10.200.$hops.2', $LISTEN_PORT))
+s.listen(1024)
+while True:
+    time.sleep(3600)
+" </dev/null >/dev/null 2>&1 &
+
+  if [ "$netem" = 0 ]; then
+    echo "warning: tc netem is not available, links have no added delay or loss" >&2
+    delay=0
+    loss=0
+  fi
+  echo "prober ${PREFIX}0 (10.200.1.1), target 10.200.$hops.2 at $hops hops," \
+    "${delay} ms and ${loss}% loss per link and direction"
+  echo "run: sudo ip netns exec ${PREFIX}0 ./tcp_traceroute -t 10.200.$hops.2"
+}
+
+case "$1" in
+  up)
+    shift
+    up "$@"
+    ;;
+  down)
+    down
+    ;;
+  *)
+    echo "usage: $0 up [HOPS] [DELAY_MS] [LOSS_PCT] | down" >&2
+    exit 1
+    ;;
+esac
@@ -5,22 +5,37 @@
 #define _GNU_SOURCE
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
 #include <netdb.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 unsigned short calculate_checksum(unsigned short *address, int bytes) {
   // Define the sum and checksum variables to be incremented
   long sum = 0;
@@ -37,8 +52,10 @@ unsigned short calculate_checksum(unsigned short *address, int bytes) {
 
   // If there is a byte left over
   if (bytes > 0) {
-    // Add the last byte after converting
-    sum += htons((unsigned short)*address);
+    // Add the last byte as the first byte of a zero-padded 16-bit word
+    unsigned short last = 0;
+    *(unsigned char *)&last = *(unsigned char *)address;
+    sum += last;
   }
 
   // While the sum is larger than 16 bits
@@ -53,6 +70,118 @@ unsigned short calculate_checksum(unsigned short *address, int bytes) {
   return checksum;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+// Add up 16-byte blocks as 16-bit words with SSE2, the 32-bit lanes are
+// flushed to the 64-bit total before they can overflow
+__attribute__((target("sse2"))) static uint64_t sum_words_sse2(
+    const unsigned char *data, size_t blocks) {
+  __m128i zero = _mm_setzero_si128();
+  uint64_t total = 0;
+
+  while (blocks > 0) {
+    // Each block adds at most 2 * 0xffff to a lane
+    size_t count = blocks < 16384 ? blocks : 16384;
+    __m128i acc = zero;
+
+    for (size_t i = 0; i < count; i++, data += 16) {
+      // Widen the eight 16-bit words to 32 bits and accumulate them
+      __m128i words = _mm_loadu_si128((const __m128i *)data);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(words, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(words, zero));
+    }
+
+    // Fold the lanes into the running total
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    total += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    blocks -= count;
+  }
+
+  return total;
+}
+
+// Same as sum_words_sse2() but on 32-byte blocks with AVX2
+__attribute__((target("avx2"))) static uint64_t sum_words_avx2(
+    const unsigned char *data, size_t blocks) {
+  __m256i zero = _mm256_setzero_si256();
+  uint64_t total = 0;
+
+  while (blocks > 0) {
+    size_t count = blocks < 16384 ? blocks : 16384;
+    __m256i acc = zero;
+
+    for (size_t i = 0; i < count; i++, data += 32) {
+      __m256i words = _mm256_loadu_si256((const __m256i *)data);
+      acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(words, zero));
+      acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(words, zero));
+    }
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    for (int lane = 0; lane < 8; lane++) {
+      total += lanes[lane];
+    }
+    blocks -= count;
+  }
+
+  return total;
+}
+#endif
+
+unsigned short calculate_checksum_simd(const void *address, int bytes) {
+  // Small buffers such as probe headers are faster with the scalar loop
+  if (bytes < 64) {
+    return calculate_checksum((unsigned short *)address, bytes);
+  }
+
+  const unsigned char *data = address;
+  uint64_t sum = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+  // Pick the widest vector unit the CPU has, once
+  static int use_avx2 = -1;
+  if (use_avx2 < 0) {
+    use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+
+  // Sum the bulk of the buffer with the vector unit
+  if (use_avx2) {
+    sum = sum_words_avx2(data, bytes / 32);
+    data += bytes & ~31;
+    bytes &= 31;
+  } else {
+    sum = sum_words_sse2(data, bytes / 16);
+    data += bytes & ~15;
+    bytes &= 15;
+  }
+#endif
+
+  // Sum the remaining tail with the scalar loop, which returns it inverted
+  sum += (unsigned short)~calculate_checksum((unsigned short *)data, bytes);
+
+  // Wrap the overflow around until the sum fits in 16 bits
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+
+  return (unsigned short)~sum;
+}
+
+void update_checksum(unsigned short *check, unsigned short old_word,
+                     unsigned short new_word) {
+  // RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'), all in one's complement
+  unsigned long sum = (unsigned short)~*check;
+  sum += (unsigned short)~old_word;
+  sum += new_word;
+
+  // Wrap the overflow around until the sum fits in 16 bits
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+
+  *check = ~sum;
+}
+
 // Define pseudo header struct
 struct pseudo_header {
   u_int32_t source_address;
@@ -62,10 +191,9 @@ struct pseudo_header {
   u_int16_t segment_length;
 };
 
-struct pseudo_header *calculate_pseudo_header(uint32_t src_addr,
-                                              uint32_t dest_addr) {
-  // Allocate memory for the pseudo_header struct and zero it all
-  struct pseudo_header *header = malloc(sizeof(struct pseudo_header));
+void calculate_pseudo_header(struct pseudo_header *header, uint32_t src_addr,
+                             uint32_t dest_addr) {
+  // Zero the caller's pseudo_header struct
   memset(header, 0, sizeof(struct pseudo_header));
 
   // Fill in the pseudo header values
@@ -79,505 +207,3924 @@ struct pseudo_header *calculate_pseudo_header(uint32_t src_addr,
   header->reserved = 0;
   // Segment Length
   header->segment_length = htons(sizeof(struct tcphdr));
+}
+
+// Size of a probe, an IP header followed by a TCP header with no options
+#define PROBE_LENGTH (sizeof(struct iphdr) + sizeof(struct tcphdr))
+
+void build_probe_template(char *packet, uint32_t src_addr, uint32_t dest_addr,
+                          int dst_port) {
+  // Zero the packet
+  memset(packet, 0, PROBE_LENGTH);
+
+  // Define the IP header structure and point it to the beginning of buffer
+  struct iphdr *ip_header = (struct iphdr *)packet;
+  // Define the TCP header structure and point it to the end of the IP header
+  struct tcphdr *tcp_header = (struct tcphdr *)(packet + sizeof(struct iphdr));
+
+  // Fill in the IP header values
+  // IPv4
+  ip_header->version = 4;
+  // Header Length: 5 = 20 bytes
+  ip_header->ihl = 5;
+  // Type of Service
+  ip_header->tos = 0;
+  // Total Size of Packet (16-bit)
+  ip_header->tot_len = htons(PROBE_LENGTH);
+  // No Fragmentation
+  ip_header->frag_off = 0;
+  // Time to Live (patched per probe)
+  ip_header->ttl = 0;
+  // Identification (16-bit)
+  ip_header->id = htons(54321);
+  // Upper layer protocol
+  ip_header->protocol = IPPROTO_TCP;
+  // Source IP
+  ip_header->saddr = src_addr;
+  // Destination IP
+  ip_header->daddr = dest_addr;
+
+  // Fill in the TCP header values, the source port and sequence number are
+  // patched per probe
+  // Destination Port (16-bit)
+  tcp_header->dest = htons(dst_port);
+  // SYN Flag set to send SYN packet
+  tcp_header->syn = 1;
+  // Window Buffer Size (16-bit)
+  tcp_header->window = htons(5840);
+  // Data Offset = 5 bytes
+  tcp_header->doff = 5;
+
+  // Calculate the IP header checksum once
+  ip_header->check =
+      calculate_checksum((unsigned short *)ip_header, sizeof(struct iphdr));
 
-  return header;
+  // Lay out the pseudo header and TCP header back to back on the stack
+  struct {
+    struct pseudo_header pseudo;
+    struct tcphdr tcp;
+  } double_header;
+  calculate_pseudo_header(&double_header.pseudo, src_addr, dest_addr);
+  memcpy(&double_header.tcp, tcp_header, sizeof(struct tcphdr));
+
+  // Calculate the TCP header checksum once
+  tcp_header->check = calculate_checksum((unsigned short *)&double_header,
+                                         sizeof(double_header));
 }
 
-int main(int argc, char *argv[]) {
-  // Define defaults for command-line arguments
-  int max_hops = 30;
-  int dst_port = 80;
-  char *target = "google.com";
-  bool help = false;
+void patch_probe_word(char *packet, size_t offset, unsigned short new_word,
+                      unsigned short *check) {
+  // Read the old 16-bit word, which may not be aligned
+  unsigned short old_word;
+  memcpy(&old_word, packet + offset, sizeof(old_word));
 
-  // Parse passed arguments, if any
-  for (int i = 1; i < argc; i++) {
-    if (strcmp(argv[i], "-m") == 0) {
-      max_hops = atoi(argv[++i]);
-    } else if (strcmp(argv[i], "-p") == 0) {
-      dst_port = atoi(argv[++i]);
-    } else if (strcmp(argv[i], "-t") == 0) {
-      target = argv[++i];
-    } else if (strcmp(argv[i], "-h") == 0) {
-      help = true;
+  // Write the new word and fold the difference into the checksum
+  memcpy(packet + offset, &new_word, sizeof(new_word));
+  update_checksum(check, old_word, new_word);
+}
+
+void set_probe_fields(char *packet, int ttl, unsigned short src_port,
+                      uint32_t seq) {
+  struct iphdr *ip_header = (struct iphdr *)packet;
+  struct tcphdr *tcp_header = (struct tcphdr *)(packet + sizeof(struct iphdr));
+
+  // The TTL shares a 16-bit word with the protocol and is only covered by the
+  // IP checksum
+  unsigned char ttl_word[2] = {(unsigned char)ttl, ip_header->protocol};
+  unsigned short new_word;
+  memcpy(&new_word, ttl_word, sizeof(new_word));
+  patch_probe_word(packet, offsetof(struct iphdr, ttl), new_word,
+                   &ip_header->check);
+
+  // The source port and sequence number are only covered by the TCP checksum
+  size_t tcp_offset = sizeof(struct iphdr);
+  uint32_t net_seq = htonl(seq);
+  unsigned short seq_words[2];
+  memcpy(seq_words, &net_seq, sizeof(net_seq));
+
+  patch_probe_word(packet, tcp_offset + offsetof(struct tcphdr, source),
+                   htons(src_port), &tcp_header->check);
+  patch_probe_word(packet, tcp_offset + offsetof(struct tcphdr, seq),
+                   seq_words[0], &tcp_header->check);
+  patch_probe_word(packet, tcp_offset + offsetof(struct tcphdr, seq) + 2,
+                   seq_words[1], &tcp_header->check);
+}
+
+double monotonic_ms() {
+  // Read the monotonic clock, which never jumps when NTP steps the wall clock
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  // Convert the seconds and nanoseconds to milliseconds
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+bool probe_checksums_valid(const char *packet) {
+  // Recompute the IP header checksum over the header including its checksum,
+  // a correct header sums to zero
+  char copy[PROBE_LENGTH];
+  memcpy(copy, packet, PROBE_LENGTH);
+  if (calculate_checksum((unsigned short *)copy, sizeof(struct iphdr)) != 0) {
+    return false;
+  }
+
+  // Do the same for the TCP header with its pseudo header in front
+  struct iphdr *ip_header = (struct iphdr *)copy;
+  struct {
+    struct pseudo_header pseudo;
+    struct tcphdr tcp;
+  } double_header;
+  calculate_pseudo_header(&double_header.pseudo, ip_header->saddr,
+                          ip_header->daddr);
+  memcpy(&double_header.tcp, copy + sizeof(struct iphdr),
+         sizeof(struct tcphdr));
+  return calculate_checksum((unsigned short *)&double_header,
+                            sizeof(double_header)) == 0;
+}
+
+int run_checksum_benchmark() {
+  // Fill a buffer with random bytes, with room for an offset start
+  static unsigned char buffer[65536 + 16];
+  srand(6760);
+  for (size_t i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = rand() & 0xff;
+  }
+
+  // Check the vector checksum against the scalar one for every length
+  int mismatches = 0;
+  for (int offset = 0; offset <= 2; offset += 2) {
+    for (int length = 0; length <= 4096; length++) {
+      unsigned short *data = (unsigned short *)(buffer + offset);
+      if (calculate_checksum(data, length) !=
+          calculate_checksum_simd(data, length)) {
+        mismatches++;
+      }
     }
   }
+  printf("checksum_simd vs checksum: %d mismatches\n", mismatches);
 
-  // Display message and return if "-h" specified
-  if (help) {
-    printf(
-        "usage: tcp_traceroute [-m MAX_HOPS] [-p DST_PORT] -t TARGET\n\n"
-        "optional arguments:\n"
-        "-h, --help   show this help message and exit\n"
-        "-m   MAX_HOPS  Max hops to probe (default = 30)\n"
-        "-p   DST_PORT  TCP destination port (default = 80)\n"
-        "-t   TARGET    Target domain or IP\n");
-    return 0;
+  // Check that incremental updates leave the probe checksums correct
+  char packet[PROBE_LENGTH];
+  build_probe_template(packet, htonl(0x0a000001), htonl(0x08080808), 80);
+  int bad_probes = 0;
+  for (int i = 0; i < 100000; i++) {
+    set_probe_fields(packet, rand() & 0xff, rand() & 0xffff, rand());
+    if (!probe_checksums_valid(packet)) {
+      bad_probes++;
+    }
   }
+  printf("incremental probe checksums: %d bad\n", bad_probes);
 
-  // // Make a writable copy of the target domain/IP
-  char *target_copy = strdup(target);
+  // Time both checksum kernels over a range of buffer sizes
+  int sizes[] = {40, 64, 576, 1500, 9000, 65536};
+  volatile unsigned short sink = 0;
+  printf("\n%8s %14s %14s\n", "bytes", "scalar MB/s", "simd MB/s");
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    // Run enough iterations to checksum about 512 MB
+    long iterations = (512L << 20) / sizes[i];
 
-  // Point where there is "://", if any
-  char *host = strstr(target_copy, "://");
+    double start = monotonic_ms();
+    for (long j = 0; j < iterations; j++) {
+      sink += calculate_checksum((unsigned short *)buffer, sizes[i]);
+    }
+    double scalar = monotonic_ms() - start;
 
-  // If there is "://", change the pointer to exclude it
-  if (host != NULL) {
-    host += 3;
+    start = monotonic_ms();
+    for (long j = 0; j < iterations; j++) {
+      sink += calculate_checksum_simd(buffer, sizes[i]);
+    }
+    double simd = monotonic_ms() - start;
+
+    printf("%8d %14.0f %14.0f\n", sizes[i], 512.0 / (scalar / 1000.0),
+           512.0 / (simd / 1000.0));
   }
 
-  // If there is not "://", point to the beginning of the domain/IP
-  else {
-    host = target;
+  // Time a full probe build against patching the template
+  long probes = 10000000;
+  double start = monotonic_ms();
+  for (long j = 0; j < probes; j++) {
+    build_probe_template(packet, htonl(0x0a000001), htonl(0x08080808), 80);
+    sink += packet[10];
   }
+  double full = monotonic_ms() - start;
 
-  // Find if there is a "/" after the domain name
-  char *slash = strchr(host, '/');
+  start = monotonic_ms();
+  for (long j = 0; j < probes; j++) {
+    set_probe_fields(packet, j & 0xff, 12345 + (j & 0xff), j);
+    sink += packet[10];
+  }
+  double patched = monotonic_ms() - start;
 
-  // If there is a "/"
-  if (slash) {
-    // Place a null terminator so the host pointer excludes the path
-    *slash = '\0';
+  printf("\nfull probe build: %.1f ns/probe\n", full * 1e6 / probes);
+  printf("template patch:   %.1f ns/probe\n", patched * 1e6 / probes);
+
+  return (mismatches || bad_probes) ? 1 : 0;
+}
+
+void enable_receive_timestamps(int sock) {
+  // Ask the kernel to attach the packet arrival time to every received packet
+  int one = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0) {
+    perror("setsockopt SO_TIMESTAMPNS");
   }
+}
 
-  // Define struct for domain
-  struct addrinfo hints, *res;
+// Define a struct for a reading of the monotonic clock taken between two
+// readings of the wall clock, used to move kernel timestamps onto the
+// monotonic clock
+typedef struct {
+  struct timespec mono;
+  struct timespec real_before;
+  struct timespec real_after;
+} ClockSample;
 
-  // Fill hints with zeros so that we can specidy sokcet type
-  memset(&hints, 0, sizeof hints);
+void sample_clocks(ClockSample *sample) {
+  // Sample the wall clock on both sides of the monotonic clock so the midpoint
+  // of the two wall clock readings lines up with the monotonic reading
+  clock_gettime(CLOCK_REALTIME, &sample->real_before);
+  clock_gettime(CLOCK_MONOTONIC, &sample->mono);
+  clock_gettime(CLOCK_REALTIME, &sample->real_after);
+}
 
-  // Define hints, AF_INET=IPV4, SOCK_STREAM=TCP
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
+double stamp_to_monotonic(const struct timespec *stamp,
+                          const ClockSample *sample) {
+  double recv_time =
+      sample->mono.tv_sec * 1000.0 + sample->mono.tv_nsec / 1000000.0;
 
-  // Get the resolved URL or IP address
-  int ip = getaddrinfo(host, NULL, &hints, &res);
+  // Calculate how long ago the packet arrived in nanoseconds
+  long long before =
+      (sample->real_before.tv_sec - stamp->tv_sec) * 1000000000LL +
+      (sample->real_before.tv_nsec - stamp->tv_nsec);
+  long long after = (sample->real_after.tv_sec - stamp->tv_sec) * 1000000000LL +
+                    (sample->real_after.tv_nsec - stamp->tv_nsec);
+  long long age = before + (after - before) / 2;
 
-  // Check that the URL resolved correctly
-  if (ip != 0) {
-    fprintf(stderr, "\nCouldn't resolve URL or IP: %s\n", gai_strerror(ip));
-    return -1;
+  // Move the arrival time onto the monotonic clock, ignoring nonsense ages
+  // caused by a wall clock step between arrival and the read
+  if (age >= 0) {
+    recv_time -= age / 1000000.0;
   }
 
-  // Create a temporary UDP socket
-  int temp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  return recv_time;
+}
 
-  // Check that the temporary socket was created successfully
-  if (temp_sock < 0) {
-    printf("\nFailed to create temporary socket\n");
-    return -1;
-  }
+double message_receive_time(struct msghdr *message,
+                            const ClockSample *sample) {
+  // Default to the time the packet was read if there is no kernel timestamp
+  double recv_time =
+      sample->mono.tv_sec * 1000.0 + sample->mono.tv_nsec / 1000000.0;
 
-  // Define struct for temporary destination address
-  struct sockaddr_in temp_addr;
+  // Look for the SO_TIMESTAMPNS control message
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(message); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(message, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      // Copy out the kernel arrival time (wall clock)
+      struct timespec stamp;
+      memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+      recv_time = stamp_to_monotonic(&stamp, sample);
+    }
+  }
 
-  // Define temporary destination address
-  temp_addr.sin_family = AF_INET;
-  temp_addr.sin_port = htons(80);
-  inet_pton(AF_INET, "8.8.8.8", &temp_addr.sin_addr);
+  return recv_time;
+}
 
-  // Connect to the temporary destination address
-  connect(temp_sock, (struct sockaddr *)&temp_addr, sizeof(temp_addr));
+int receive_with_timestamp(int sock, char *buffer, size_t length,
+                           struct sockaddr_in *recv_addr, double *recv_time) {
+  // Define the data and control buffers for recvmsg()
+  struct iovec iov = {.iov_base = buffer, .iov_len = length};
+  char control[CMSG_SPACE(sizeof(struct timespec))];
+  struct msghdr message;
 
-  // Define struct for Local IP address and length
-  struct sockaddr_in src_addr;
-  socklen_t src_len = sizeof(src_addr);
+  // Fill in the message header with the source address, data, and control
+  memset(&message, 0, sizeof(message));
+  message.msg_name = recv_addr;
+  message.msg_namelen = sizeof(*recv_addr);
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
 
-  // Get socket name of temp socket to extract local IP and then close it
-  getsockname(temp_sock, (struct sockaddr *)&src_addr, &src_len);
-  close(temp_sock);
+  // Read the packet along with its control messages
+  int read = recvmsg(sock, &message, 0);
 
-  // Define a raw socket to send, AF_INET=IPv4, IPPROTO_RAW=Manual IP header
-  int raw_sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+  // Sample the clocks right after the read
+  ClockSample sample;
+  sample_clocks(&sample);
 
-  // Check that the raw socket was created successfully
-  if (raw_sock < 0) {
-    printf(
-        "\nFailed to create raw socket, make sure you are executing as root\n");
-    return -1;
+  // Without a packet there is no control message to look at
+  if (read < 0) {
+    message.msg_controllen = 0;
   }
+  *recv_time = message_receive_time(&message, &sample);
 
-  // Tell OS that we are building our own IP headers
-  int one = 1;
-  setsockopt(raw_sock, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one));
+  return read;
+}
 
-  // Define socket to listen for TTL expirations, IPPROTO_ICMP=ICMP packets
-  int icmp_sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+// Define a struct for a smoothed RTT estimator, as TCP uses for its
+// retransmission timeout (RFC 6298)
+typedef struct {
+  double srtt;
+  double rttvar;
+  int samples;
+} RttEstimator;
 
-  // Check that the raw socket was created successfully
-  if (icmp_sock < 0) {
-    printf(
-        "\nFailed to create raw socket, make sure you are executing as root\n");
-    return -1;
+void update_rtt(RttEstimator *estimator, double rtt) {
+  // The first sample sets the average and half of it as the variation
+  if (estimator->samples++ == 0) {
+    estimator->srtt = rtt;
+    estimator->rttvar = rtt / 2;
+    return;
   }
 
-  // Define a raw socket to listen for TCP SYN-ACK, IPPROTO_TCP=TCP packets
-  int tcp_sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+  // Later samples are blended in with gains of 1/4 and 1/8
+  double error = rtt > estimator->srtt ? rtt - estimator->srtt
+                                       : estimator->srtt - rtt;
+  estimator->rttvar = 0.75 * estimator->rttvar + 0.25 * error;
+  estimator->srtt = 0.875 * estimator->srtt + 0.125 * rtt;
+}
 
-  // Check that the raw socket was created successfully
-  if (tcp_sock < 0) {
-    printf(
-        "\nFailed to create raw socket, make sure you are executing as root\n");
-    return -1;
+double reply_timeout(const RttEstimator *estimator, double min_wait,
+                     double max_wait) {
+  // Wait the longest until a reply has been seen
+  if (estimator->samples == 0) {
+    return max_wait;
   }
 
-  // Define struct for destination address
-  struct sockaddr_in destination;
+  // Each hop is further away than the replies seen so far, so allow at least
+  // twice the smoothed RTT as well as four times its variation
+  double variation = 4 * estimator->rttvar;
+  double timeout = estimator->srtt +
+                   (variation > estimator->srtt ? variation : estimator->srtt);
 
-  // Define destination, htons() converts destination port to big-endian
-  destination.sin_family = AF_INET;
-  destination.sin_port = htons(dst_port);
+  // Keep the timeout within the configured bounds
+  if (timeout < min_wait) {
+    return min_wait;
+  }
+  return timeout > max_wait ? max_wait : timeout;
+}
 
-  // Cast the binary IP to a sockaddr_in struct and define sin_addr
-  destination.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+// Number of probes sent to each hop, as in the classic traceroute output
+#define PROBES_PER_HOP 3
 
-  printf("traceroute to %s (%s), %d hops max, TCP SYN to port %d\n", target,
-         inet_ntoa(destination.sin_addr), max_hops, dst_port);
+// First source port, the probe for hop N is sent from PROBE_BASE_PORT + N, or
+// every probe of a flow from PROBE_BASE_PORT + flow ID with "-F" and "-A"
+#define PROBE_BASE_PORT 12345
+#define PROBE_PORTS 255
+#define IS_PROBE_PORT(port) \
+  ((port) > PROBE_BASE_PORT && (port) <= PROBE_BASE_PORT + PROBE_PORTS)
 
-  // Start from 1 and iterate until max_hops
-  for (int hop = 1; hop <= max_hops; hop++) {
-    // Define variables for ending early
-    bool synack = false;
-    bool rst = false;
-    bool terminate = false;
+// Encode the TTL and probe number of a probe into its TCP sequence number,
+// routers quote it back in ICMP errors and targets acknowledge it
+#define PROBE_SEQ(ttl, probe) (((uint32_t)(probe) << 8) | (uint32_t)(ttl))
+#define SEQ_TTL(seq) ((int)((seq) & 0xff))
+#define SEQ_PROBE(seq) ((int)(((seq) >> 8) & 0xff))
 
-    // Print the hop number
-    printf("%2d  ", hop);
+// Define the states of a probe
+enum { PROBE_UNSENT, PROBE_PENDING, PROBE_ANSWERED, PROBE_EXPIRED };
 
-    // Create a buffer for the packet and fill it with zeros
-    char packet[4096];
-    memset(packet, 0, sizeof(packet));
-
-    // Define the IP header structure and point it to the beginning of buffer
-    struct iphdr *ip_header = (struct iphdr *)packet;
-    // Define the TCP header structure and point it to the end of the IP header
-    struct tcphdr *tcp_header =
-        (struct tcphdr *)(packet + sizeof(struct iphdr));
-
-    // Fill in the IP header values
-    // IPv4
-    ip_header->version = 4;
-    // Header Length: 5 = 20 bytes
-    ip_header->ihl = 5;
-    // Type of Service
-    ip_header->tos = 0;
-    // Total Size of Packet (16-bit)
-    ip_header->tot_len = htons(sizeof(struct iphdr) + sizeof(struct tcphdr));
-    // No Fragmentation
-    ip_header->frag_off = 0;
-    // Time to Live
-    ip_header->ttl = hop;
-    // Identification (16-bit)
-    ip_header->id = htons(54321);
-    // Upper layer protocol
-    ip_header->protocol = IPPROTO_TCP;
-    // Checksum (calculate later)s
-    ip_header->check = 0;
-    // Source IP
-    ip_header->saddr = src_addr.sin_addr.s_addr;
-    // Destination IP
-    ip_header->daddr = destination.sin_addr.s_addr;
-
-    // Fill in the TCP header values
-    // Source Port (16-bit)
-    tcp_header->source = htons(12345 + hop);
-    // Destination Port (16-bit)
-    tcp_header->dest = htons(dst_port);
-    // Sequence Number (32 bit)
-    tcp_header->seq = htonl(hop);
-    // SYN Flag set to send SYN packet
-    tcp_header->syn = 1;
-    // Window Buffer Size (16-bit)
-    tcp_header->window = htons(5840);
-    // Data Offset = 5 bytes
-    tcp_header->doff = 5;
-    // Checksum (calculate later)
-    tcp_header->check = 0;
-
-    // Calculate the IP header checksum and apply it
-    ip_header->check =
-        calculate_checksum((unsigned short *)ip_header, sizeof(struct iphdr));
-
-    // Calculate the pseudo header for the TCP header
-    struct pseudo_header *pseudo_header =
-        calculate_pseudo_header(ip_header->saddr, ip_header->daddr);
-
-    // Allocate memory for pseudo_header struct and TCP header and zero it all
-    unsigned short *double_header =
-        malloc(sizeof(struct pseudo_header) + sizeof(struct tcphdr));
-    memset(double_header, 0,
-           sizeof(struct pseudo_header) + sizeof(struct tcphdr));
-
-    // Copy the pseudo header to the beginning
-    memcpy(double_header, pseudo_header, sizeof(struct pseudo_header));
-    // Then, copy the TCP header after
-    memcpy(double_header + (unsigned short)(sizeof(struct pseudo_header) /
-                                            sizeof(unsigned short)),
-           tcp_header, sizeof(struct tcphdr));
-    // memcpy((char *)double_header + sizeof(struct pseudo_header), tcp_header,
-    // sizeof(struct tcphdr));
-
-    // Calculate the TCP header checksum
-    tcp_header->check = calculate_checksum(
-        (unsigned short *)double_header,
-        (sizeof(struct pseudo_header) + sizeof(struct tcphdr)));
-
-    // Free memory allocations
-    free(double_header);
-    free(pseudo_header);
+// Define a struct for the result of a single probe, the send time in ms since
+// the start is a double since a float loses sub-ms precision within hours
+typedef struct {
+  uint32_t reply_addr;
+  float rtt;
+  double sent;
+  uint8_t state;
+} ProbeResult;
 
-    // Define variables for next loop
-    double first_time;
-    double second_time;
-    char first_addr[INET_ADDRSTRLEN];
-    char second_addr[INET_ADDRSTRLEN];
-    char first_host[NI_MAXHOST];
-    char second_host[NI_MAXHOST];
+// Define a struct for a target of the multi-target mode, forward and backward
+// are the next TTLs Doubletree probes in each direction, 0 once stopped
+typedef struct {
+  uint32_t address;
+  char *name;
+  int reached;
+  int gap_stop;
+  int forward;
+  int backward;
+  RttEstimator estimator;
+  ProbeResult *probes;
+} TraceTarget;
 
-    // Loop for three probes
-    for (int probe = 1; probe <= 3; probe++) {
-      // Define local variables
-      double rtt = 0.0;
-      struct timeval send_time, recv_time;
-      char addrstr[INET_ADDRSTRLEN];
-      char host[NI_MAXHOST];
+// Define a struct for the command-line options
+typedef struct {
+  int max_hops;
+  int dst_port;
+  char *target;
+  char *target_file;
+  int rate;
+  double min_wait;
+  double max_wait;
+  int gap_limit;
+  double monitor_interval;
+  double probe_interval;
+  int runs;
+  double run_delay;
+  char *json_output;
+  char *log_file;
+  char *pcap_file;
+  int start_ttl;
+  char *stop_set_file;
+  bool packet_ring;
+  bool paris;
+  bool multipath;
+  double confidence;
+} TraceOptions;
 
-      // Get the current time and apply it to send_time before sending
-      gettimeofday(&send_time, NULL);
+int probe_port(const TraceOptions *options, int ttl) {
+  // Keep the 5-tuple of every probe the same with "-F", so load balancers
+  // hashing on it send every hop's probes down one path
+  return PROBE_BASE_PORT + (options->paris ? 1 : ttl);
+}
 
-      // Send the packet to the destination
-      int sent = sendto(raw_sock, packet, ntohs(ip_header->tot_len), 0,
-                        (struct sockaddr *)&destination, sizeof(destination));
+bool is_probe_port(const TraceOptions *options, int port, uint32_t seq) {
+  // Check the source port agrees with the sequence number, the flow ID with
+  // "-A", the fixed port with "-F" and the TTL otherwise
+  if (options->multipath) {
+    return IS_PROBE_PORT(port) && port == PROBE_BASE_PORT + SEQ_PROBE(seq);
+  }
+  return port == probe_port(options, SEQ_TTL(seq));
+}
 
-      // Check if the packet was sent successfully
-      if (sent < 0) {
-        perror("sendto");
-        return 0;
-      }
+int find_source_address(uint32_t dest_addr, struct sockaddr_in *src_addr) {
+  // Create a temporary UDP socket
+  int temp_sock = socket(AF_INET, SOCK_DGRAM, 0);
 
-      // Define variable for storing sockets to listen to
-      fd_set readfds;
+  // Check that the temporary socket was created successfully
+  if (temp_sock < 0) {
+    printf("\nFailed to create temporary socket\n");
+    return -1;
+  }
 
-      // Clear out the set, then add the ICMP and TCP sockets
-      FD_ZERO(&readfds);
-      FD_SET(icmp_sock, &readfds);
-      FD_SET(tcp_sock, &readfds);
+  // Define struct for temporary destination address
+  struct sockaddr_in temp_addr;
 
-      // Define the max file descriptor then add 1 for select(), tcp_sock
-      // because created last
-      int maxfd = tcp_sock + 1;
+  // Define the temporary destination as the target itself, so the address of
+  // the interface that routes to it is used
+  temp_addr.sin_family = AF_INET;
+  temp_addr.sin_port = htons(80);
+  temp_addr.sin_addr.s_addr = dest_addr;
 
-      // Define a time interval structure for setting the timeout for select()
-      struct timeval tv;
+  // Connect to the temporary destination address, no packet is sent
+  if (connect(temp_sock, (struct sockaddr *)&temp_addr, sizeof(temp_addr)) <
+      0) {
+    perror("connect");
+    close(temp_sock);
+    return -1;
+  }
 
-      // Define the timeout as 10.5 seconds
-      tv.tv_sec = 3;
-      tv.tv_usec = 500000;
+  // Get socket name of temp socket to extract local IP and then close it
+  socklen_t src_len = sizeof(*src_addr);
+  getsockname(temp_sock, (struct sockaddr *)src_addr, &src_len);
+  close(temp_sock);
 
-      // Listen to the ICMP and TCP sockets simultaneously
-      int rv = select(maxfd, &readfds, NULL, NULL, &tv);
+  return 0;
+}
 
-      // Handle the select() function return
-      if (rv == -1) {
-        perror("select");
-      } else {
-        // If the ICMP socket has data
-        if (FD_ISSET(icmp_sock, &readfds)) {
-          // Define local variables
-          char icmp_buffer[4096];
-          struct sockaddr_in recv_addr;
-          socklen_t addr_length = sizeof recv_addr;
+void drain_socket(int sock) {
+  // Throw away anything queued before the filter was attached
+  char buffer[4096];
+  while (recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+  }
+}
 
-          // Read the data on the ICMP sockeet
-          int read = recvfrom(icmp_sock, icmp_buffer, sizeof(icmp_buffer), 0,
-                              (struct sockaddr *)&recv_addr, &addr_length);
+// Reply filters are at most this many instructions long
+#define REPLY_FILTER_MAX 32
 
-          // Check if the data was received successfully
-          if (read < 0) {
-            perror("sendto");
-            return 0;
-          }
+// Define a struct for the ICMP and TCP reply filter programs
+typedef struct {
+  struct sock_filter icmp[REPLY_FILTER_MAX];
+  int icmp_length;
+  struct sock_filter tcp[REPLY_FILTER_MAX];
+  int tcp_length;
+} ReplyFilters;
 
-          // Get the current time and apply it to recv_time before receiving
-          gettimeofday(&recv_time, NULL);
+void build_reply_filters(ReplyFilters *filters, uint32_t src_addr,
+                         uint32_t target_addr, int max_hops) {
+  // Our probes use source ports PROBE_BASE_PORT + 1 to PROBE_BASE_PORT + TTL,
+  // or up to the highest flow ID with "-A"
+  uint32_t first_port = PROBE_BASE_PORT + 1;
+  uint32_t last_port = PROBE_BASE_PORT + max_hops;
 
-          // Calculate the Round Trip Time (RTT) in milliseconds
-          rtt = (recv_time.tv_sec - send_time.tv_sec) * 1000.0;
-          rtt += (recv_time.tv_usec - send_time.tv_usec) / 1000.0;
+  // Raw socket filters see the packet from the IP header, loads are big-endian
+  // ICMP: accept time exceeded (11) and unreachable (3) quoting a TCP probe
+  // from our address and one of our source ports
+  struct sock_filter icmp_code[] = {
+      // X = outer IP header length
+      BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+      // ICMP type
+      BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 11, 1, 0),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 3, 0, 13),
+      // Quoted IP protocol
+      BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8 + 9),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 11),
+      // Quoted source address
+      BPF_STMT(BPF_LD | BPF_W | BPF_IND, 8 + 12),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(src_addr), 0, 9),
+      // X = outer IP header length + quoted IP header length
+      BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8),
+      BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x0f),
+      BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),
+      BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      // Quoted TCP source port
+      BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8),
+      BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, first_port, 0, 2),
+      BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, last_port, 1, 0),
+      BPF_STMT(BPF_RET | BPF_K, 0xffff),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
 
-          // Convert the binary address to a string
-          inet_ntop(AF_INET, &recv_addr.sin_addr, addrstr, sizeof addrstr);
+  // TCP: accept SYN-ACKs and RSTs to one of our source ports
+  struct sock_filter tcp_tail[] = {
+      // X = IP header length
+      BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+      // Destination port
+      BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+      BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, first_port, 0, 6),
+      BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, last_port, 5, 0),
+      // Flags, RST or both SYN and ACK
+      BPF_STMT(BPF_LD | BPF_B | BPF_IND, 13),
+      BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, TH_RST, 2, 0),
+      BPF_STMT(BPF_ALU | BPF_AND | BPF_K, TH_SYN | TH_ACK),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TH_SYN | TH_ACK, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, 0xffff),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  int tail_length = sizeof(tcp_tail) / sizeof(tcp_tail[0]);
 
-          // Resolve the domain
-          int resolved =
-              getnameinfo((struct sockaddr *)&recv_addr, sizeof(recv_addr),
-                          host, sizeof(host), NULL, 0, NI_NAMEREQD);
+  // When there is a single target, also require the segment to come from it,
+  // a mismatch jumps to the final drop
+  struct sock_filter *tcp_code = filters->tcp;
+  int tcp_length = 0;
+  if (target_addr != 0) {
+    tcp_code[tcp_length++] =
+        (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12);
+    tcp_code[tcp_length++] = (struct sock_filter)BPF_JUMP(
+        BPF_JMP | BPF_JEQ | BPF_K, ntohl(target_addr), 0, tail_length - 1);
+  }
+  memcpy(tcp_code + tcp_length, tcp_tail, sizeof(tcp_tail));
+  filters->tcp_length = tcp_length + tail_length;
 
-          // If the domain could not be resolved
-          if (resolved != 0) {
-            // Assign the host to be the IP
-            snprintf(host, sizeof(host), "%s", addrstr);
-          }
-        }
+  memcpy(filters->icmp, icmp_code, sizeof(icmp_code));
+  filters->icmp_length = sizeof(icmp_code) / sizeof(icmp_code[0]);
+}
 
-        // If the TCP socket has data
-        if (FD_ISSET(tcp_sock, &readfds)) {
-          // Define local variables
-          char tcp_buffer[4096];
-          struct sockaddr_in recv_addr;
-          socklen_t addr_length = sizeof recv_addr;
+int attach_reply_filters(int icmp_sock, int tcp_sock, uint32_t src_addr,
+                         uint32_t target_addr, int max_hops) {
+  ReplyFilters filters;
+  build_reply_filters(&filters, src_addr, target_addr, max_hops);
 
-          // Read the data on the TCP socket
-          int read = recvfrom(tcp_sock, tcp_buffer, sizeof(tcp_buffer), 0,
-                              (struct sockaddr *)&recv_addr, &addr_length);
+  struct sock_fprog icmp_program = {.len = filters.icmp_length,
+                                    .filter = filters.icmp};
+  struct sock_fprog tcp_program = {.len = filters.tcp_length,
+                                   .filter = filters.tcp};
 
-          // Check if the data was received successfully
-          if (read < 0) {
-            perror("sendto");
-            return 0;
-          }
+  // Attach the filters so the kernel drops everything else
+  if (setsockopt(icmp_sock, SOL_SOCKET, SO_ATTACH_FILTER, &icmp_program,
+                 sizeof(icmp_program)) < 0 ||
+      setsockopt(tcp_sock, SOL_SOCKET, SO_ATTACH_FILTER, &tcp_program,
+                 sizeof(tcp_program)) < 0) {
+    perror("setsockopt SO_ATTACH_FILTER");
+    return -1;
+  }
 
-          // Get the current time and apply it to recv_time before receiving
-          gettimeofday(&recv_time, NULL);
+  // Packets that arrived before the filters were attached are still queued
+  drain_socket(icmp_sock);
+  drain_socket(tcp_sock);
 
-          // Calculate the Round Trip Time (RTT) in milliseconds
-          rtt = (recv_time.tv_sec - send_time.tv_sec) * 1000.0;
-          rtt += (recv_time.tv_usec - send_time.tv_usec) / 1000.0;
+  return 0;
+}
 
-          // Format the beginning of the received message to an IP header
-          struct iphdr *tcp_ip_header = (struct iphdr *)tcp_buffer;
+// The packet ring is PACKET_RING_BLOCKS blocks of PACKET_RING_BLOCK_SIZE bytes,
+// a block is handed over once full or after PACKET_RING_TIMEOUT ms
+#define PACKET_RING_BLOCK_SIZE (1 << 20)
+#define PACKET_RING_BLOCKS 16
+#define PACKET_RING_FRAME_SIZE 2048
+#define PACKET_RING_TIMEOUT 5
 
-          // Get the length of the IP header
-          int tcp_ip_header_length = tcp_ip_header->ihl * 4;
+// Define a struct for an AF_PACKET socket with a TPACKET_V3 receive ring
+typedef struct {
+  int fd;
+  uint8_t *map;
+  struct tpacket_req3 request;
+  unsigned int block;
+} PacketRing;
 
-          // Format the message following the IP header to a TCP header
-          struct tcphdr *tcp_tcp_header =
-              (struct tcphdr *)(tcp_buffer + tcp_ip_header_length);
+int open_packet_ring(PacketRing *ring, uint32_t src_addr, int max_hops) {
+  ring->fd = -1;
+  ring->map = NULL;
+  ring->block = 0;
 
-          // If received IP is not the destination IP
-          if (tcp_ip_header->saddr != destination.sin_addr.s_addr) {
-            // Set the address to "*" (invalid)
-            strcpy(addrstr, "*");
-          }
+  // Receive IPv4 packets from the IP header on, like the raw sockets
+  int fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+  if (fd < 0) {
+    perror("socket AF_PACKET");
+    return -1;
+  }
 
-          else {
-            // Convert the binary address to a string
-            inet_ntop(AF_INET, &recv_addr.sin_addr, addrstr, sizeof addrstr);
+  // Combine both reply filters: ICMP packets run the ICMP program, TCP
+  // segments the TCP program, everything else is dropped
+  ReplyFilters filters;
+  build_reply_filters(&filters, src_addr, 0, max_hops);
+  struct sock_filter code[3 + 2 * REPLY_FILTER_MAX];
+  int length = 0;
+  code[length++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9);
+  code[length++] = (struct sock_filter)BPF_JUMP(
+      BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, filters.icmp_length);
+  memcpy(&code[length], filters.icmp,
+         filters.icmp_length * sizeof(struct sock_filter));
+  length += filters.icmp_length;
+  code[length++] = (struct sock_filter)BPF_JUMP(
+      BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, filters.tcp_length);
+  memcpy(&code[length], filters.tcp,
+         filters.tcp_length * sizeof(struct sock_filter));
+  length += filters.tcp_length;
+  code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+  struct sock_fprog program = {.len = length, .filter = code};
 
-            // Resolve the domain
-            int resolved =
-                getnameinfo((struct sockaddr *)&recv_addr, sizeof(recv_addr),
-                            host, sizeof(host), NULL, 0, NI_NAMEREQD);
+  // Skip our own outgoing probes, frames keep the kernel's software stamp
+  // since a NIC's hardware stamp is on its own clock, not CLOCK_REALTIME
+  int version = TPACKET_V3;
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &program,
+                 sizeof(program)) < 0 ||
+      setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) <
+          0) {
+    perror("setsockopt packet ring");
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
 
-            // If the domain could not be resolved
-            if (resolved != 0) {
+  // Set up the ring of blocks and map it into our memory
+  struct tpacket_req3 *request = &ring->request;
+  memset(request, 0, sizeof(*request));
+  request->tp_block_size = PACKET_RING_BLOCK_SIZE;
+  request->tp_block_nr = PACKET_RING_BLOCKS;
+  request->tp_frame_size = PACKET_RING_FRAME_SIZE;
+  request->tp_frame_nr = PACKET_RING_BLOCK_SIZE / PACKET_RING_FRAME_SIZE *
+                         PACKET_RING_BLOCKS;
+  request->tp_retire_blk_tov = PACKET_RING_TIMEOUT;
+  if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, request, sizeof(*request)) <
+      0) {
+    perror("setsockopt PACKET_RX_RING");
+    close(fd);
+    return -1;
+  }
+  ring->map = mmap(NULL, (size_t)PACKET_RING_BLOCK_SIZE * PACKET_RING_BLOCKS,
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+  if (ring->map == MAP_FAILED) {
+    ring->map = mmap(NULL, (size_t)PACKET_RING_BLOCK_SIZE * PACKET_RING_BLOCKS,
+                     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (ring->map == MAP_FAILED) {
+    perror("mmap packet ring");
+    ring->map = NULL;
+    close(fd);
+    return -1;
+  }
+
+  // Capture from every interface
+  struct sockaddr_ll address = {.sll_family = AF_PACKET,
+                                .sll_protocol = htons(ETH_P_IP)};
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    perror("bind packet ring");
+    munmap(ring->map, (size_t)PACKET_RING_BLOCK_SIZE * PACKET_RING_BLOCKS);
+    ring->map = NULL;
+    close(fd);
+    return -1;
+  }
+
+  ring->fd = fd;
+  return 0;
+}
+
+void close_packet_ring(PacketRing *ring) {
+  if (ring->fd < 0) {
+    return;
+  }
+
+  // Report the packets the ring had no room for
+  struct tpacket_stats_v3 stats = {0};
+  socklen_t length = sizeof(stats);
+  if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &length) ==
+      0) {
+    fprintf(stderr, "packet ring: %u replies, %u dropped\n", stats.tp_packets,
+            stats.tp_drops);
+  }
+
+  munmap(ring->map, (size_t)PACKET_RING_BLOCK_SIZE * PACKET_RING_BLOCKS);
+  close(ring->fd);
+  ring->fd = -1;
+}
+
+void set_probe_destination(char *packet, uint32_t dest_addr) {
+  struct iphdr *ip_header = (struct iphdr *)packet;
+  struct tcphdr *tcp_header = (struct tcphdr *)(packet + sizeof(struct iphdr));
+
+  // The destination address is covered by the IP checksum and, through the
+  // pseudo header, by the TCP checksum
+  unsigned short old_words[2], new_words[2];
+  memcpy(old_words, &ip_header->daddr, sizeof(old_words));
+  memcpy(new_words, &dest_addr, sizeof(new_words));
+
+  for (int i = 0; i < 2; i++) {
+    patch_probe_word(packet, offsetof(struct iphdr, daddr) + 2 * i,
+                     new_words[i], &ip_header->check);
+    update_checksum(&tcp_header->check, old_words[i], new_words[i]);
+  }
+}
+
+int compare_target_address(const void *a, const void *b) {
+  // Compare two targets by address in host byte order, then by position in
+  // the list so the first of any duplicates sorts first
+  TraceTarget *first = *(TraceTarget *const *)a;
+  TraceTarget *second = *(TraceTarget *const *)b;
+  uint32_t first_addr = ntohl(first->address);
+  uint32_t second_addr = ntohl(second->address);
+
+  if (first_addr != second_addr) {
+    return (first_addr > second_addr) - (first_addr < second_addr);
+  }
+  return (first > second) - (first < second);
+}
+
+int remove_duplicate_targets(TraceTarget *targets, int count) {
+  // Sort pointers to the targets so duplicates end up next to each other
+  TraceTarget **sorted = malloc(count * sizeof(TraceTarget *));
+  bool *duplicate = calloc(count, sizeof(bool));
+  for (int i = 0; i < count; i++) {
+    sorted[i] = &targets[i];
+  }
+  qsort(sorted, count, sizeof(TraceTarget *), compare_target_address);
+
+  // Mark every copy after the first listed one
+  for (int i = 1; i < count; i++) {
+    if (sorted[i]->address == sorted[i - 1]->address) {
+      duplicate[sorted[i] - targets] = true;
+    }
+  }
+
+  // Compact the targets, keeping the listed order
+  int kept = 0;
+  for (int i = 0; i < count; i++) {
+    if (duplicate[i]) {
+      free(targets[i].name);
+    } else {
+      targets[kept++] = targets[i];
+    }
+  }
+
+  free(duplicate);
+  free(sorted);
+  return kept;
+}
+
+TraceTarget *find_target(TraceTarget **sorted, int count, uint32_t address) {
+  // Binary search the targets sorted by address
+  int low = 0;
+  int high = count - 1;
+  uint32_t wanted = ntohl(address);
+
+  while (low <= high) {
+    int middle = low + (high - low) / 2;
+    uint32_t current = ntohl(sorted[middle]->address);
+
+    if (current == wanted) {
+      return sorted[middle];
+    } else if (current < wanted) {
+      low = middle + 1;
+    } else {
+      high = middle - 1;
+    }
+  }
+
+  return NULL;
+}
+
+int add_target(TraceTarget **targets, int *count, int *capacity,
+               uint32_t address, const char *name) {
+  // Grow the target array when it is full
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 256;
+    TraceTarget *grown = realloc(*targets, *capacity * sizeof(TraceTarget));
+    if (!grown) {
+      perror("realloc");
+      return -1;
+    }
+    *targets = grown;
+  }
+
+  // Fill in the new target, results are allocated once all are loaded
+  TraceTarget *target = &(*targets)[(*count)++];
+  memset(target, 0, sizeof(TraceTarget));
+  target->address = address;
+  target->name = name ? strdup(name) : NULL;
+
+  return 0;
+}
+
+int load_targets(const char *path, TraceTarget **targets, int *count) {
+  // Open the target list, "-" reads from stdin
+  FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+  // Check that the target list was opened successfully
+  if (!fp) {
+    perror("fopen target list");
+    return -1;
+  }
+
+  int capacity = 0;
+  char line[512];
+  *targets = NULL;
+  *count = 0;
+
+  // Read the target list one line at a time
+  while (fgets(line, sizeof(line), fp)) {
+    // Cut the line at a comment and trim the whitespace around the entry
+    line[strcspn(line, "#\r\n")] = '\0';
+    char *entry = line + strspn(line, " \t");
+    entry[strcspn(entry, " \t")] = '\0';
+
+    // Skip empty lines
+    if (*entry == '\0') {
+      continue;
+    }
+
+    // If the entry is a CIDR prefix, add every address in it
+    char *slash = strchr(entry, '/');
+    if (slash) {
+      *slash = '\0';
+      int prefix = atoi(slash + 1);
+      struct in_addr network;
+
+      // Only accept sensible prefixes, a /16 is already 64k targets whose
+      // probe results take over 100 MB
+      if (inet_pton(AF_INET, entry, &network) != 1 || prefix < 16 ||
+          prefix > 32) {
+        fprintf(stderr, "Skipping invalid prefix: %s/%s\n", entry, slash + 1);
+        continue;
+      }
+
+      // Mask off the host bits and add each address of the prefix
+      uint32_t mask = prefix == 32 ? 0xffffffff : ~(0xffffffffu >> prefix);
+      uint32_t first = ntohl(network.s_addr) & mask;
+      uint64_t size = 1ULL << (32 - prefix);
+      for (uint64_t i = 0; i < size; i++) {
+        if (add_target(targets, count, &capacity, htonl(first + i), NULL) < 0) {
+          return -1;
+        }
+      }
+      continue;
+    }
+
+    // If the entry is a literal IP, add it without a name
+    struct in_addr literal;
+    if (inet_pton(AF_INET, entry, &literal) == 1) {
+      if (add_target(targets, count, &capacity, literal.s_addr, NULL) < 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    // Otherwise resolve the domain
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int ip = getaddrinfo(entry, NULL, &hints, &res);
+    if (ip != 0) {
+      fprintf(stderr, "Couldn't resolve %s: %s\n", entry, gai_strerror(ip));
+      continue;
+    }
+
+    uint32_t address = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(res);
+    if (add_target(targets, count, &capacity, address, entry) < 0) {
+      return -1;
+    }
+  }
+
+  // Close the target list
+  if (fp != stdin) {
+    fclose(fp);
+  }
+
+  return 0;
+}
+
+int parse_icmp_reply(const TraceOptions *options, const unsigned char *buffer,
+                     int length, uint32_t src_addr, uint32_t *probe_dest,
+                     uint32_t *seq) {
+  // Skip the outer IP header
+  const struct iphdr *ip_header = (const struct iphdr *)buffer;
+  int offset = ip_header->ihl * 4;
+
+  // Make sure the ICMP header and a quoted IP header are present
+  if (length < offset + 8 + (int)sizeof(struct iphdr)) {
+    return -1;
+  }
+
+  // Only time exceeded and destination unreachable quote our probe
+  int type = buffer[offset];
+  if (type != 11 && type != 3) {
+    return -1;
+  }
+
+  // Skip the 8 byte ICMP header to the quoted IP header
+  const struct iphdr *quoted = (const struct iphdr *)(buffer + offset + 8);
+  int quoted_offset = offset + 8 + quoted->ihl * 4;
+
+  // Check the quote is one of our TCP probes and has the first 8 TCP bytes
+  if (quoted->protocol != IPPROTO_TCP || quoted->saddr != src_addr ||
+      length < quoted_offset + 8) {
+    return -1;
+  }
+
+  // The first 8 bytes of the TCP header hold the ports and sequence number
+  const struct tcphdr *tcp_header =
+      (const struct tcphdr *)(buffer + quoted_offset);
+  if (!is_probe_port(options, ntohs(tcp_header->source),
+                     ntohl(tcp_header->seq))) {
+    return -1;
+  }
+
+  *probe_dest = quoted->daddr;
+  *seq = ntohl(tcp_header->seq);
+  return type;
+}
+
+int parse_tcp_reply(const TraceOptions *options, const unsigned char *buffer,
+                    int length, uint32_t *target_addr, uint32_t *seq) {
+  // Skip the IP header to the TCP header
+  const struct iphdr *ip_header = (const struct iphdr *)buffer;
+  int offset = ip_header->ihl * 4;
+  if (length < offset + (int)sizeof(struct tcphdr)) {
+    return -1;
+  }
+  const struct tcphdr *tcp_header = (const struct tcphdr *)(buffer + offset);
+
+  // Only a SYN-ACK or RST acknowledging one of our probes ends a trace
+  if (!((tcp_header->syn && tcp_header->ack) || tcp_header->rst)) {
+    return -1;
+  }
+
+  // The acknowledgment number is our sequence number plus one
+  uint32_t acked = ntohl(tcp_header->ack_seq) - 1;
+  if (!is_probe_port(options, ntohs(tcp_header->dest), acked)) {
+    return -1;
+  }
+
+  *target_addr = ip_header->saddr;
+  *seq = acked;
+  return 0;
+}
+
+// Every probe and reply can be archived as a fixed-size record in a binary log
+// file. The file starts with a TraceLogHeader, followed by TraceRecords in
+// host byte order with addresses in network byte order.
+#define TRACE_LOG_MAGIC "TRLG"
+#define TRACE_LOG_VERSION 1
+#define TRACE_LOG_PROBE 1
+#define TRACE_LOG_REPLY 2
+
+// Records are written by a background thread from a ring of TRACE_LOG_RING
+// records, TRACE_LOG_CHUNK at a time
+#define TRACE_LOG_RING 65536
+#define TRACE_LOG_CHUNK 4096
+
+// Define a struct for the header at the start of a log file
+typedef struct {
+  char magic[4];
+  uint16_t version;
+  uint16_t record_size;
+  int64_t start_ns;
+} TraceLogHeader;
+
+// Define a struct for one probe or reply record, times are relative to the
+// start of the log and the reply fields are zero for probes
+typedef struct {
+  uint8_t kind;
+  uint8_t ttl;
+  uint8_t reply_type;
+  uint8_t reply_code;
+  uint32_t seq;
+  uint32_t target;
+  uint32_t address;
+  uint64_t time_ns;
+  float rtt;
+  uint8_t reply_ttl;
+  uint8_t protocol;
+  uint16_t dst_port;
+} TraceRecord;
+
+_Static_assert(sizeof(TraceRecord) == 32, "TraceRecord must be 32 bytes");
+
+// Define a struct for the binary log and pcap outputs of a trace
+typedef struct {
+  // Log file, ring of records not written yet and the writer thread
+  int fd;
+  TraceRecord *ring;
+  uint64_t head;
+  uint64_t tail;
+  bool stopping;
+  bool failed;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t drained;
+
+  // Raw reply capture
+  FILE *pcap;
+
+  // Start of the log on the monotonic clock and on the wall clock in ns
+  double start;
+  int64_t start_ns;
+} TraceLog;
+
+void *write_trace_log(void *arg) {
+  TraceLog *log = (TraceLog *)arg;
+
+  pthread_mutex_lock(&log->lock);
+  while (true) {
+    // Wait for a full chunk, or for whatever is left when stopping
+    while (log->head - log->tail < TRACE_LOG_CHUNK && !log->stopping) {
+      pthread_cond_wait(&log->filled, &log->lock);
+    }
+    uint64_t count = log->head - log->tail;
+    if (count == 0) {
+      break;
+    }
+
+    // Write up to the end of the ring without holding the lock, the producer
+    // never overwrites records that have not been written
+    uint64_t offset = log->tail % TRACE_LOG_RING;
+    if (count > TRACE_LOG_RING - offset) {
+      count = TRACE_LOG_RING - offset;
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    const char *data = (const char *)&log->ring[offset];
+    size_t remaining = count * sizeof(TraceRecord);
+    bool failed = false;
+    while (remaining > 0) {
+      ssize_t written = write(log->fd, data, remaining);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("write trace log");
+        failed = true;
+        break;
+      }
+      data += written;
+      remaining -= written;
+    }
+
+    // Hand the written records back to the producer, after an error only the
+    // ones that reached the file count as written and the writer stops, the
+    // producer drops records from then on
+    pthread_mutex_lock(&log->lock);
+    log->tail += count - (remaining + sizeof(TraceRecord) - 1) /
+                             sizeof(TraceRecord);
+    pthread_cond_signal(&log->drained);
+    if (failed) {
+      log->failed = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&log->lock);
+
+  return NULL;
+}
+
+int open_trace_log(TraceLog *log, const char *log_path,
+                   const char *pcap_path) {
+  memset(log, 0, sizeof(TraceLog));
+  log->fd = -1;
+
+  // Remember when the log started on both clocks
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  log->start = monotonic_ms();
+  log->start_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+  // Open the binary log, write its header and start the writer thread
+  if (log_path) {
+    log->fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log->fd < 0) {
+      perror("open trace log");
+      return -1;
+    }
+
+    TraceLogHeader header = {.version = TRACE_LOG_VERSION,
+                             .record_size = sizeof(TraceRecord),
+                             .start_ns = log->start_ns};
+    memcpy(header.magic, TRACE_LOG_MAGIC, sizeof(header.magic));
+    if (write(log->fd, &header, sizeof(header)) != sizeof(header)) {
+      perror("write trace log");
+      return -1;
+    }
+
+    log->ring = malloc(TRACE_LOG_RING * sizeof(TraceRecord));
+    if (!log->ring) {
+      perror("malloc");
+      return -1;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->filled, NULL);
+    pthread_cond_init(&log->drained, NULL);
+    pthread_create(&log->writer, NULL, write_trace_log, log);
+  }
+
+  // Open the pcap file and write its global header for raw IPv4 packets
+  if (pcap_path) {
+    log->pcap = fopen(pcap_path, "wb");
+    if (!log->pcap) {
+      perror("fopen pcap");
+      return -1;
+    }
+    setvbuf(log->pcap, NULL, _IOFBF, 1 << 20);
+
+    struct {
+      uint32_t magic;
+      uint16_t version_major;
+      uint16_t version_minor;
+      int32_t thiszone;
+      uint32_t sigfigs;
+      uint32_t snaplen;
+      uint32_t linktype;
+    } header = {0xa1b23c4d, 2, 4, 0, 0, 65535, 101};
+    fwrite(&header, sizeof(header), 1, log->pcap);
+  }
+
+  return 0;
+}
+
+void append_trace_record(TraceLog *log, TraceRecord *record) {
+  if (log->fd < 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&log->lock);
+
+  // Wait for the writer if the disk falls a whole ring behind, nothing more
+  // is kept once writing the log has failed
+  while (log->head - log->tail == TRACE_LOG_RING && !log->failed) {
+    pthread_cond_wait(&log->drained, &log->lock);
+  }
+  if (log->failed) {
+    pthread_mutex_unlock(&log->lock);
+    return;
+  }
+  log->ring[log->head % TRACE_LOG_RING] = *record;
+  log->head++;
+
+  // Wake the writer once a chunk is ready
+  if (log->head - log->tail == TRACE_LOG_CHUNK) {
+    pthread_cond_signal(&log->filled);
+  }
+
+  pthread_mutex_unlock(&log->lock);
+}
+
+uint64_t trace_log_time(TraceLog *log, double time) {
+  // Convert a monotonic time in ms to ns since the start of the log
+  return time > log->start ? (uint64_t)((time - log->start) * 1000000.0) : 0;
+}
+
+void log_probe(TraceLog *log, double sent, uint32_t target, int ttl,
+               uint32_t seq, int dst_port) {
+  TraceRecord record = {.kind = TRACE_LOG_PROBE,
+                        .ttl = ttl,
+                        .seq = seq,
+                        .target = target,
+                        .time_ns = trace_log_time(log, sent),
+                        .dst_port = dst_port};
+  append_trace_record(log, &record);
+}
+
+void log_reply(TraceLog *log, const unsigned char *packet, int length,
+               double recv_time, uint32_t target, uint32_t seq,
+               uint32_t reply_addr, double rtt) {
+  // Keep the IP TTL and the ICMP type and code, or the TCP flags, of the reply
+  const struct iphdr *ip_header = (const struct iphdr *)packet;
+  int header_length = ip_header->ihl * 4;
+  TraceRecord record = {.kind = TRACE_LOG_REPLY,
+                        .ttl = SEQ_TTL(seq),
+                        .seq = seq,
+                        .target = target,
+                        .address = reply_addr,
+                        .time_ns = trace_log_time(log, recv_time),
+                        .rtt = rtt,
+                        .reply_ttl = ip_header->ttl,
+                        .protocol = ip_header->protocol};
+  if (ip_header->protocol == IPPROTO_ICMP && length >= header_length + 2) {
+    record.reply_type = packet[header_length];
+    record.reply_code = packet[header_length + 1];
+  } else if (ip_header->protocol == IPPROTO_TCP &&
+             length >= header_length + 14) {
+    record.reply_code = packet[header_length + 13];
+  }
+  append_trace_record(log, &record);
+}
+
+void capture_packet(TraceLog *log, const char *packet, int length,
+                    double recv_time) {
+  if (!log->pcap || length <= 0) {
+    return;
+  }
+
+  // Stamp the packet with its arrival time on the wall clock
+  int64_t time_ns = log->start_ns + (int64_t)trace_log_time(log, recv_time);
+  uint32_t header[4] = {time_ns / 1000000000LL, time_ns % 1000000000LL,
+                        length, length};
+  fwrite(header, sizeof(header), 1, log->pcap);
+  fwrite(packet, length, 1, log->pcap);
+}
+
+int close_trace_log(TraceLog *log) {
+  int status = 0;
+
+  // Let the writer thread write out the rest of the ring and stop, then
+  // report whether any records were lost
+  if (log->fd >= 0) {
+    pthread_mutex_lock(&log->lock);
+    log->stopping = true;
+    pthread_cond_signal(&log->filled);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->writer, NULL);
+
+    if (log->failed) {
+      fprintf(stderr, "\n%llu records were not written to the trace log\n",
+              (unsigned long long)(log->head - log->tail));
+      status = -1;
+    }
+    if (close(log->fd) < 0) {
+      perror("close trace log");
+      status = -1;
+    }
+    free(log->ring);
+    log->fd = -1;
+  }
+
+  if (log->pcap) {
+    if (fclose(log->pcap) != 0) {
+      perror("fclose pcap");
+      status = -1;
+    }
+    log->pcap = NULL;
+  }
+
+  return status;
+}
+
+int decode_trace_log(const char *path, bool json) {
+  // Open the log file
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror("fopen trace log");
+    return -1;
+  }
+
+  // Check the header before reading any records
+  TraceLogHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, TRACE_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_LOG_VERSION ||
+      header.record_size != sizeof(TraceRecord)) {
+    fprintf(stderr, "\n%s is not a trace log of this version\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  // Print when the log started
+  char timestamp[32];
+  time_t start = header.start_ns / 1000000000LL;
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S",
+           localtime(&start));
+  if (!json) {
+    printf("trace log started %s\n", timestamp);
+  }
+
+  // Print every record as a line of text or a JSON object per line
+  TraceRecord records[1024];
+  size_t count;
+  while ((count = fread(records, sizeof(TraceRecord), 1024, fp)) > 0) {
+    for (size_t i = 0; i < count; i++) {
+      TraceRecord *record = &records[i];
+      char target[INET_ADDRSTRLEN];
+      char address[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &record->target, target, sizeof target);
+      inet_ntop(AF_INET, &record->address, address, sizeof address);
+      double time = record->time_ns / 1000000.0;
+      bool probe = record->kind == TRACE_LOG_PROBE;
+
+      if (json && probe) {
+        printf("{\"kind\": \"probe\", \"time\": %.6f, \"target\": \"%s\", "
+               "\"ttl\": %u, \"seq\": %u, \"dst_port\": %u}\n",
+               time, target, record->ttl, record->seq, record->dst_port);
+      } else if (json) {
+        printf("{\"kind\": \"reply\", \"time\": %.6f, \"target\": \"%s\", "
+               "\"ttl\": %u, \"seq\": %u, \"address\": \"%s\", "
+               "\"protocol\": %u, \"type\": %u, \"code\": %u, "
+               "\"reply_ttl\": %u, \"rtt\": ",
+               time, target, record->ttl, record->seq, address,
+               record->protocol, record->reply_type, record->reply_code,
+               record->reply_ttl);
+        if (record->rtt >= 0) {
+          printf("%.6f}\n", record->rtt);
+        } else {
+          printf("null}\n");
+        }
+      } else if (probe) {
+        printf("%14.6f  probe  %-15s ttl %3u  seq %-8u port %u\n", time,
+               target, record->ttl, record->seq, record->dst_port);
+      } else {
+        printf("%14.6f  reply  %-15s ttl %3u  seq %-8u from %-15s ", time,
+               target, record->ttl, record->seq, address);
+        if (record->protocol == IPPROTO_ICMP) {
+          printf("icmp %u/%u", record->reply_type, record->reply_code);
+        } else {
+          printf("tcp flags 0x%02x", record->reply_code);
+        }
+        printf("  ip ttl %3u", record->reply_ttl);
+        if (record->rtt >= 0) {
+          printf("  %.3f ms\n", record->rtt);
+        } else {
+          printf("  unmatched\n");
+        }
+      }
+    }
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+// Probes are sent and replies read in batches of this many messages
+#define SEND_BATCH 64
+#define RECV_BATCH 64
+#define RECV_BUFFER_SIZE 1024
+
+// Largest memory taken by the probe results of a "-T" trace
+#define MAX_RESULT_BYTES (1ULL << 30)
+
+// Probe timeouts are kept in a timer wheel of TIMER_SLOTS slots, each
+// TIMER_TICK_MS wide, timeouts longer than one turn of the wheel (a little
+// over 10 seconds) wait out their remaining turns in the slot
+#define TIMER_TICK_MS 10
+#define TIMER_SLOTS 1024
+#define TIMER_NONE UINT32_MAX
+
+// Define a struct for a probe's link in the timer wheel
+typedef struct {
+  uint32_t next;
+  uint32_t rounds;
+} TimerLink;
+
+// Define a struct for the multi-target probe engine, probes are identified by
+// their slot (target index * max_hops * PROBES_PER_HOP + hop slot) in probes
+typedef struct {
+  // Sockets and the epoll instance watching the receive sockets
+  int raw_sock;
+  int icmp_sock;
+  int tcp_sock;
+  int epoll_fd;
+  uint32_t src_addr;
+
+  // Options, targets in listed order and sorted by address, and their probe
+  // results
+  const TraceOptions *options;
+  TraceTarget *targets;
+  TraceTarget **sorted;
+  int count;
+  int max_hops;
+  ProbeResult *probes;
+  double start;
+
+  // Binary log and pcap outputs
+  TraceLog *log;
+
+  // Packet ring replacing the receive sockets with "-k"
+  PacketRing ring;
+
+  // Probe template and the batch of probes waiting for sendmmsg()
+  char probe_template[PROBE_LENGTH];
+  char packets[SEND_BATCH][PROBE_LENGTH];
+  struct sockaddr_in addresses[SEND_BATCH];
+  struct iovec send_iov[SEND_BATCH];
+  struct mmsghdr send_msgs[SEND_BATCH];
+  uint32_t queued_slots[SEND_BATCH];
+  int queued;
+
+  // Buffers for recvmmsg()
+  char recv_buffers[RECV_BATCH][RECV_BUFFER_SIZE];
+  char recv_control[RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+  struct sockaddr_in recv_addrs[RECV_BATCH];
+  struct iovec recv_iov[RECV_BATCH];
+  struct mmsghdr recv_msgs[RECV_BATCH];
+
+  // Timer wheel of singly linked lists of probe slots
+  uint32_t wheel[TIMER_SLOTS];
+  TimerLink *timers;
+  uint64_t tick;
+  uint64_t outstanding;
+  uint64_t sent;
+} ProbeEngine;
+
+ProbeEngine *create_engine(const TraceOptions *options, int raw_sock,
+                           int icmp_sock, int tcp_sock, uint32_t src_addr,
+                           TraceTarget *targets, int count, ProbeResult *probes,
+                           TraceLog *log) {
+  int max_hops = options->max_hops;
+  int dst_port = options->dst_port;
+
+  // Allocate the engine and the timer links for every probe
+  ProbeEngine *engine = calloc(1, sizeof(ProbeEngine));
+  size_t total = (size_t)count * max_hops * PROBES_PER_HOP;
+  if (!engine || !(engine->timers = malloc(total * sizeof(TimerLink)))) {
+    perror("malloc");
+    free(engine);
+    return NULL;
+  }
+
+  engine->options = options;
+  engine->raw_sock = raw_sock;
+  engine->icmp_sock = icmp_sock;
+  engine->tcp_sock = tcp_sock;
+  engine->src_addr = src_addr;
+  engine->targets = targets;
+  engine->count = count;
+  engine->max_hops = max_hops;
+  engine->probes = probes;
+  engine->log = log;
+
+  // Sort pointers to the targets by address for matching replies
+  engine->sorted = malloc(count * sizeof(TraceTarget *));
+  for (int i = 0; i < count; i++) {
+    engine->sorted[i] = &targets[i];
+  }
+  qsort(engine->sorted, count, sizeof(TraceTarget *), compare_target_address);
+
+  // Build the probe once, the destination and per-hop fields are patched
+  build_probe_template(engine->probe_template, src_addr, targets[0].address,
+                       dst_port);
+
+  // Point each send message at its own packet and destination
+  for (int i = 0; i < SEND_BATCH; i++) {
+    engine->addresses[i].sin_family = AF_INET;
+    engine->addresses[i].sin_port = htons(dst_port);
+    engine->send_iov[i].iov_base = engine->packets[i];
+    engine->send_iov[i].iov_len = PROBE_LENGTH;
+    engine->send_msgs[i].msg_hdr.msg_name = &engine->addresses[i];
+    engine->send_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    engine->send_msgs[i].msg_hdr.msg_iov = &engine->send_iov[i];
+    engine->send_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // Point each receive message at its own buffer, address and control data
+  for (int i = 0; i < RECV_BATCH; i++) {
+    engine->recv_iov[i].iov_base = engine->recv_buffers[i];
+    engine->recv_iov[i].iov_len = RECV_BUFFER_SIZE;
+    engine->recv_msgs[i].msg_hdr.msg_name = &engine->recv_addrs[i];
+    engine->recv_msgs[i].msg_hdr.msg_iov = &engine->recv_iov[i];
+    engine->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    engine->recv_msgs[i].msg_hdr.msg_control = engine->recv_control[i];
+  }
+
+  // Start with an empty timer wheel, probe times are relative to now
+  for (int i = 0; i < TIMER_SLOTS; i++) {
+    engine->wheel[i] = TIMER_NONE;
+  }
+  engine->start = monotonic_ms();
+  srand(time(NULL) ^ getpid());
+
+  // With "-k", replies are read from a packet ring instead, the receive sockets
+  // are left with a filter that drops everything
+  engine->epoll_fd = epoll_create1(0);
+  engine->ring.fd = -1;
+  if (options->packet_ring) {
+    if (open_packet_ring(&engine->ring, src_addr, max_hops) < 0) {
+      close(engine->epoll_fd);
+      free(engine->timers);
+      free(engine->sorted);
+      free(engine);
+      return NULL;
+    }
+    struct sock_filter drop = BPF_STMT(BPF_RET | BPF_K, 0);
+    struct sock_fprog program = {.len = 1, .filter = &drop};
+    setsockopt(icmp_sock, SOL_SOCKET, SO_ATTACH_FILTER, &program,
+               sizeof(program));
+    setsockopt(tcp_sock, SOL_SOCKET, SO_ATTACH_FILTER, &program,
+               sizeof(program));
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = engine->ring.fd};
+    epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, engine->ring.fd, &event);
+    return engine;
+  }
+
+  // Watch both receive sockets with epoll, they are drained without blocking
+  int sockets[2] = {icmp_sock, tcp_sock};
+  for (int i = 0; i < 2; i++) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = sockets[i]};
+    fcntl(sockets[i], F_SETFL, fcntl(sockets[i], F_GETFL) | O_NONBLOCK);
+
+    // Give the kernel room to queue reply bursts between batches, as root the
+    // rmem_max limit can be overridden
+    int buffer_size = 8 << 20;
+    setsockopt(sockets[i], SOL_SOCKET, SO_RCVBUFFORCE, &buffer_size,
+               sizeof(buffer_size));
+
+    if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, sockets[i], &event) < 0) {
+      perror("epoll_ctl");
+    }
+  }
+
+  return engine;
+}
+
+void destroy_engine(ProbeEngine *engine) {
+  close_packet_ring(&engine->ring);
+  close(engine->epoll_fd);
+  free(engine->timers);
+  free(engine->sorted);
+  free(engine);
+}
+
+void schedule_timeout(ProbeEngine *engine, uint32_t slot, double deadline) {
+  // Round the deadline up to the next tick, counting the whole turns of the
+  // wheel it lies beyond
+  uint64_t tick = (uint64_t)((deadline - engine->start) / TIMER_TICK_MS) + 1;
+  if (tick < engine->tick) {
+    tick = engine->tick;
+  }
+
+  // Push the probe onto the list for that tick
+  uint32_t *head = &engine->wheel[tick % TIMER_SLOTS];
+  engine->timers[slot].next = *head;
+  engine->timers[slot].rounds = (tick - engine->tick) / TIMER_SLOTS;
+  *head = slot;
+}
+
+void check_gap(ProbeEngine *engine, TraceTarget *target) {
+  int gap_limit = engine->options->gap_limit;
+  int silent = 0;
+
+  // Look for the first run of gap_limit hops where every probe timed out
+  for (int ttl = 1; gap_limit > 0 && ttl <= engine->max_hops; ttl++) {
+    ProbeResult *hop = &target->probes[(ttl - 1) * PROBES_PER_HOP];
+    bool all_expired = true;
+    for (int probe = 0; probe < PROBES_PER_HOP; probe++) {
+      all_expired = all_expired && hop[probe].state == PROBE_EXPIRED;
+    }
+
+    silent = all_expired ? silent + 1 : 0;
+    if (silent == gap_limit) {
+      // Stop probing past the end of the gap
+      if (target->gap_stop == 0 || ttl < target->gap_stop) {
+        target->gap_stop = ttl;
+      }
+      return;
+    }
+  }
+}
+
+void expire_timeouts(ProbeEngine *engine, double now) {
+  uint32_t per_target = engine->max_hops * PROBES_PER_HOP;
+
+  // Fire every tick up to now, a probe that was answered is simply skipped
+  uint64_t current = (uint64_t)((now - engine->start) / TIMER_TICK_MS);
+  while (engine->tick <= current) {
+    uint32_t *head = &engine->wheel[engine->tick % TIMER_SLOTS];
+    uint32_t slot = *head;
+    *head = TIMER_NONE;
+
+    while (slot != TIMER_NONE) {
+      // Put back probes with turns left, their deadline is a later pass
+      uint32_t next = engine->timers[slot].next;
+      if (engine->timers[slot].rounds > 0 &&
+          engine->probes[slot].state == PROBE_PENDING) {
+        engine->timers[slot].rounds--;
+        engine->timers[slot].next = *head;
+        *head = slot;
+      } else if (engine->probes[slot].state == PROBE_PENDING) {
+        engine->probes[slot].state = PROBE_EXPIRED;
+        engine->outstanding--;
+        check_gap(engine, &engine->targets[slot / per_target]);
+      }
+      slot = next;
+    }
+
+    engine->tick++;
+  }
+}
+
+void flush_probes(ProbeEngine *engine) {
+  uint32_t per_target = engine->max_hops * PROBES_PER_HOP;
+  int done = 0;
+
+  // Send the queued probes, sendmmsg() may send only part of the batch
+  while (done < engine->queued) {
+    double sent = monotonic_ms();
+    int count = sendmmsg(engine->raw_sock, &engine->send_msgs[done],
+                         engine->queued - done, 0);
+
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      // Give up on the rest of the batch, it is not waited for but counts
+      // towards the gap limit like a probe that timed out
+      perror("sendmmsg");
+      for (int i = done; i < engine->queued; i++) {
+        uint32_t slot = engine->queued_slots[i];
+        engine->probes[slot].state = PROBE_EXPIRED;
+        check_gap(engine, &engine->targets[slot / per_target]);
+      }
+      break;
+    }
+
+    // Start the timeout of every probe that went out, adapted to the RTTs
+    // seen from its target so far
+    for (int i = done; i < done + count; i++) {
+      uint32_t slot = engine->queued_slots[i];
+      TraceTarget *target = &engine->targets[slot / per_target];
+      double timeout =
+          reply_timeout(&target->estimator, engine->options->min_wait,
+                        engine->options->max_wait);
+
+      engine->probes[slot].sent = sent - engine->start;
+      engine->probes[slot].state = PROBE_PENDING;
+      engine->outstanding++;
+      engine->sent++;
+      schedule_timeout(engine, slot, sent + timeout);
+
+      // Archive the probe, its TTL and number follow from the slot
+      int hop_slot = slot % per_target;
+      int ttl = hop_slot / PROBES_PER_HOP + 1;
+      log_probe(engine->log, sent, target->address, ttl,
+                PROBE_SEQ(ttl, hop_slot % PROBES_PER_HOP),
+                engine->options->dst_port);
+    }
+    done += count;
+  }
+
+  engine->queued = 0;
+}
+
+void queue_probe(ProbeEngine *engine, uint32_t slot, TraceTarget *target,
+                 int ttl, int probe) {
+  // Patch the template for this probe and copy it into the batch
+  set_probe_destination(engine->probe_template, target->address);
+  set_probe_fields(engine->probe_template, ttl,
+                   probe_port(engine->options, ttl),
+                   PROBE_SEQ(ttl, probe));
+
+  int i = engine->queued++;
+  memcpy(engine->packets[i], engine->probe_template, PROBE_LENGTH);
+  engine->addresses[i].sin_addr.s_addr = target->address;
+  engine->queued_slots[i] = slot;
+
+  // Send the batch once it is full
+  if (engine->queued == SEND_BATCH) {
+    flush_probes(engine);
+  }
+}
+
+double record_reply(ProbeEngine *engine, uint32_t probe_dest, uint32_t seq,
+                    uint32_t reply_addr, double recv_time, bool final) {
+  // Find the target the probe was sent to
+  TraceTarget *target = find_target(engine->sorted, engine->count, probe_dest);
+  int ttl = SEQ_TTL(seq);
+  int probe = SEQ_PROBE(seq);
+  if (!target || ttl < 1 || ttl > engine->max_hops ||
+      probe >= PROBES_PER_HOP) {
+    return -1;
+  }
+
+  // Only keep the first reply to a probe that is still waited for
+  ProbeResult *result = &target->probes[(ttl - 1) * PROBES_PER_HOP + probe];
+  if (result->state != PROBE_PENDING) {
+    return -1;
+  }
+  result->state = PROBE_ANSWERED;
+  result->reply_addr = reply_addr;
+  double rtt = (recv_time - engine->start) - result->sent;
+  result->rtt = rtt;
+  engine->outstanding--;
+  update_rtt(&target->estimator, rtt);
+
+  // Remember the lowest TTL the destination answered at
+  if (final && (target->reached == 0 || ttl < target->reached)) {
+    target->reached = ttl;
+  }
+
+  return rtt;
+}
+
+void process_reply(ProbeEngine *engine, const unsigned char *buffer,
+                   int length, double recv_time) {
+  const struct iphdr *ip_header = (const struct iphdr *)buffer;
+  uint32_t reply_addr = ip_header->saddr;
+  uint32_t probe_dest, seq;
+  capture_packet(engine->log, (const char *)buffer, length, recv_time);
+
+  if (ip_header->protocol == IPPROTO_ICMP) {
+    // Match ICMP errors by the quoted probe, an unreachable ends the trace
+    // like traceroute's !H/!N
+    int type = parse_icmp_reply(engine->options, buffer, length,
+                                engine->src_addr, &probe_dest, &seq);
+    if (type >= 0) {
+      double rtt = record_reply(engine, probe_dest, seq, reply_addr, recv_time,
+                                type == 3);
+      log_reply(engine->log, buffer, length, recv_time, probe_dest, seq,
+                reply_addr, rtt);
+    }
+  } else if (parse_tcp_reply(engine->options, buffer, length, &probe_dest,
+                             &seq) == 0) {
+    // Match SYN-ACKs and RSTs by the acknowledgment number
+    double rtt =
+        record_reply(engine, probe_dest, seq, probe_dest, recv_time, true);
+    log_reply(engine->log, buffer, length, recv_time, probe_dest, seq,
+              probe_dest, rtt);
+  }
+}
+
+void receive_ring_replies(ProbeEngine *engine) {
+  PacketRing *ring = &engine->ring;
+
+  // Handle every block the kernel has handed over, in ring order
+  while (true) {
+    struct tpacket_block_desc *block =
+        (struct tpacket_block_desc *)(ring->map +
+                                      (size_t)ring->block *
+                                          ring->request.tp_block_size);
+    if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+          TP_STATUS_USER)) {
+      break;
+    }
+
+    // Parse the replies in place, timed by the stamps in their frame headers.
+    // Without a software stamp the kernel still fills them from the wall
+    // clock when the frame is queued, which is much closer to the arrival
+    // than reading the block, only hardware stamps are on another clock
+    ClockSample sample;
+    sample_clocks(&sample);
+    double read_time =
+        sample.mono.tv_sec * 1000.0 + sample.mono.tv_nsec / 1000000.0;
+    struct tpacket3_hdr *frame =
+        (struct tpacket3_hdr *)((uint8_t *)block +
+                                block->hdr.bh1.offset_to_first_pkt);
+    for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+      double recv_time = read_time;
+      if (!(frame->tp_status & TP_STATUS_TS_RAW_HARDWARE)) {
+        struct timespec stamp = {frame->tp_sec, frame->tp_nsec};
+        recv_time = stamp_to_monotonic(&stamp, &sample);
+      }
+      process_reply(engine, (uint8_t *)frame + frame->tp_net,
+                    frame->tp_snaplen, recv_time);
+      frame = (struct tpacket3_hdr *)((uint8_t *)frame + frame->tp_next_offset);
+    }
+
+    // Hand the block back to the kernel
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+    ring->block = (ring->block + 1) % ring->request.tp_block_nr;
+  }
+}
+
+void receive_replies(ProbeEngine *engine, int sock) {
+  while (true) {
+    // recvmmsg() overwrites the address and control lengths, reset them
+    for (int i = 0; i < RECV_BATCH; i++) {
+      engine->recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      engine->recv_msgs[i].msg_hdr.msg_controllen =
+          sizeof(engine->recv_control[i]);
+    }
+
+    // Read up to a batch of replies without blocking
+    int count =
+        recvmmsg(sock, engine->recv_msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+    if (count <= 0) {
+      break;
+    }
+
+    // Sample the clocks once for the whole batch
+    ClockSample sample;
+    sample_clocks(&sample);
+
+    for (int i = 0; i < count; i++) {
+      process_reply(engine, (unsigned char *)engine->recv_buffers[i],
+                    engine->recv_msgs[i].msg_len,
+                    message_receive_time(&engine->recv_msgs[i].msg_hdr,
+                                         &sample));
+    }
+
+    // A short batch means the queue is empty
+    if (count < RECV_BATCH) {
+      break;
+    }
+  }
+}
+
+// Probe slots are shuffled by a balanced Feistel network of SHUFFLE_ROUNDS
+// rounds over the smallest even number of bits that covers them
+#define SHUFFLE_ROUNDS 4
+
+// Define a struct for a random permutation of the numbers 0 to total - 1
+typedef struct {
+  uint64_t total;
+  int half_bits;
+  uint64_t keys[SHUFFLE_ROUNDS];
+} SlotShuffle;
+
+void init_slot_shuffle(SlotShuffle *shuffle, uint64_t total) {
+  // Pick the width of each half and a random key per round
+  shuffle->total = total;
+  shuffle->half_bits = 1;
+  while ((1ULL << (2 * shuffle->half_bits)) < total) {
+    shuffle->half_bits++;
+  }
+  for (int i = 0; i < SHUFFLE_ROUNDS; i++) {
+    shuffle->keys[i] = ((uint64_t)rand() << 31) | rand();
+  }
+}
+
+uint64_t shuffle_slot(const SlotShuffle *shuffle, uint64_t index) {
+  // The network permutes every number of its width, numbers at or past total
+  // are sent through it again until they land inside, which keeps the result
+  // a permutation of 0 to total - 1
+  int bits = shuffle->half_bits;
+  uint64_t mask = (1ULL << bits) - 1;
+  do {
+    uint64_t left = index >> bits;
+    uint64_t right = index & mask;
+    for (int i = 0; i < SHUFFLE_ROUNDS; i++) {
+      uint64_t mixed = (right ^ shuffle->keys[i]) * 0x9e3779b97f4a7c15ULL;
+      uint64_t next = left ^ ((mixed ^ (mixed >> 29)) & mask);
+      left = right;
+      right = next;
+    }
+    index = (left << bits) | right;
+  } while (index >= shuffle->total);
+  return index;
+}
+
+void send_probes(ProbeEngine *engine, const uint32_t *slots, uint64_t total) {
+  // Walk the probe slots, or every (target, TTL, probe) without a list, in a
+  // random order, so neither consecutive probes nor the gaps between them
+  // follow the target-major order of the slots
+  uint64_t per_target = (uint64_t)engine->max_hops * PROBES_PER_HOP;
+  SlotShuffle shuffle;
+  init_slot_shuffle(&shuffle, total);
+
+  // Pace probes with a token bucket, allowing at most 10 ms of catch-up burst
+  double interval = 1000.0 / engine->options->rate;
+  double next_send = monotonic_ms();
+  uint64_t index = 0;
+
+  while (true) {
+    double now = monotonic_ms();
+
+    // Queue every probe that is due, full batches are sent as they fill
+    while (index < total && now >= next_send) {
+      uint64_t slot = shuffle_slot(&shuffle, index);
+      slot = slots ? slots[slot] : slot;
+      index++;
+
+      // Decode the slot into the target, TTL and probe number
+      TraceTarget *target = &engine->targets[slot / per_target];
+      int ttl = (slot % per_target) / PROBES_PER_HOP + 1;
+      int probe = slot % PROBES_PER_HOP;
+
+      // Skip hops beyond where the destination has already answered, or
+      // beyond a gap of silent hops
+      if ((target->reached && ttl > target->reached) ||
+          (target->gap_stop && ttl > target->gap_stop)) {
+        continue;
+      }
+
+      queue_probe(engine, slot, target, ttl, probe);
+
+      next_send += interval;
+      if (next_send < now - 10.0) {
+        next_send = now - 10.0;
+      }
+    }
+
+    // Send what is left of the batch and expire overdue probes
+    flush_probes(engine);
+    now = monotonic_ms();
+    expire_timeouts(engine, now);
+
+    // Stop once every probe is sent and has been answered or timed out
+    if (index >= total && engine->outstanding == 0) {
+      break;
+    }
+
+    // Sleep until the next probe is due or the next timer tick
+    double wake = engine->start + engine->tick * TIMER_TICK_MS;
+    if (index < total && next_send < wake) {
+      wake = next_send;
+    }
+    int timeout = wake > now ? (int)(wake - now) + 1 : 0;
+
+    // Drain whichever sockets have replies
+    struct epoll_event events[2];
+    int ready = epoll_wait(engine->epoll_fd, events, 2, timeout);
+    for (int i = 0; i < ready; i++) {
+      if (events[i].data.fd == engine->ring.fd) {
+        receive_ring_replies(engine);
+      } else {
+        receive_replies(engine, events[i].data.fd);
+      }
+    }
+  }
+}
+
+void trace_targets(ProbeEngine *engine) {
+  // Send every probe to every target
+  send_probes(engine, NULL,
+              (uint64_t)engine->count * engine->max_hops * PROBES_PER_HOP);
+}
+
+// Doubletree keys the global stop set by the destination's /STOP_SET_PREFIX
+// prefix, so one entry covers every destination behind the same interface
+#define STOP_SET_PREFIX 24
+
+// Define a struct for a set of 64-bit keys, an open-addressing hash table
+// where 0 marks an empty entry
+typedef struct {
+  uint64_t *keys;
+  size_t capacity;
+  size_t count;
+} StopSet;
+
+size_t stop_set_index(const StopSet *set, uint64_t key) {
+  // Fibonacci hashing, capacity is always a power of two
+  int bits = __builtin_ctzll(set->capacity);
+  return (key * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+}
+
+bool stop_set_contains(const StopSet *set, uint64_t key) {
+  if (set->capacity == 0) {
+    return false;
+  }
+
+  // Probe linearly until the key or an empty entry is found
+  size_t i = stop_set_index(set, key);
+  while (set->keys[i] != key) {
+    if (set->keys[i] == 0) {
+      return false;
+    }
+    i = (i + 1) & (set->capacity - 1);
+  }
+  return true;
+}
+
+bool stop_set_add(StopSet *set, uint64_t key) {
+  // Keep the table at most half full, rehashing into twice the space
+  if (2 * (set->count + 1) > set->capacity) {
+    StopSet grown = {.capacity = set->capacity ? set->capacity * 2 : 1024};
+    grown.keys = calloc(grown.capacity, sizeof(uint64_t));
+    if (!grown.keys) {
+      perror("calloc");
+      return false;
+    }
+    for (size_t i = 0; i < set->capacity; i++) {
+      if (set->keys[i]) {
+        stop_set_add(&grown, set->keys[i]);
+      }
+    }
+    free(set->keys);
+    *set = grown;
+  }
+
+  // Insert the key unless it is already there
+  size_t i = stop_set_index(set, key);
+  while (set->keys[i] != 0) {
+    if (set->keys[i] == key) {
+      return false;
+    }
+    i = (i + 1) & (set->capacity - 1);
+  }
+  set->keys[i] = key;
+  set->count++;
+  return true;
+}
+
+uint64_t global_stop_key(uint32_t interface, uint32_t destination) {
+  // Pair the interface with the destination's prefix
+  uint32_t mask = htonl(~0U << (32 - STOP_SET_PREFIX));
+  return ((uint64_t)interface << 32) | (destination & mask);
+}
+
+int load_stop_set(const char *path, StopSet *set) {
+  // A missing file is an empty stop set, it is created when saved
+  FILE *fp = fopen(path, "r");
+  if (!fp && errno == ENOENT) {
+    return 0;
+  } else if (!fp) {
+    perror("fopen stop set");
+    return -1;
+  }
+
+  // Each line holds an interface and a destination prefix, a key that is
+  // neither added nor already there means the table could not grow
+  int status = 0;
+  char line[128];
+  while (fgets(line, sizeof(line), fp)) {
+    char interface[INET_ADDRSTRLEN], prefix[INET_ADDRSTRLEN];
+    struct in_addr interface_addr, prefix_addr;
+    if (sscanf(line, "%15s %15[0-9.]", interface, prefix) == 2 &&
+        inet_pton(AF_INET, interface, &interface_addr) == 1 &&
+        inet_pton(AF_INET, prefix, &prefix_addr) == 1) {
+      uint64_t key =
+          global_stop_key(interface_addr.s_addr, prefix_addr.s_addr);
+      if (!stop_set_add(set, key) && !stop_set_contains(set, key)) {
+        status = -1;
+        goto done;
+      }
+    }
+  }
+  if (ferror(fp)) {
+    perror("read stop set");
+    status = -1;
+  }
+
+done:
+  // Leave an empty set behind on error
+  fclose(fp);
+  if (status < 0) {
+    free(set->keys);
+    *set = (StopSet){0};
+  }
+  return status;
+}
+
+int save_stop_set(const char *path, const StopSet *set) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    perror("fopen stop set");
+    return -1;
+  }
+
+  // Write one "interface prefix/length" line per entry
+  for (size_t i = 0; i < set->capacity; i++) {
+    if (set->keys[i] == 0) {
+      continue;
+    }
+    uint32_t interface = set->keys[i] >> 32;
+    uint32_t prefix = (uint32_t)set->keys[i];
+    char interface_str[INET_ADDRSTRLEN], prefix_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &interface, interface_str, sizeof interface_str);
+    inet_ntop(AF_INET, &prefix, prefix_str, sizeof prefix_str);
+    fprintf(fp, "%s %s/%d\n", interface_str, prefix_str, STOP_SET_PREFIX);
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+bool check_stop_set(TraceTarget *target, int ttl, StopSet *local,
+                    StopSet *global, bool forward) {
+  ProbeResult *hop = &target->probes[(ttl - 1) * PROBES_PER_HOP];
+  bool hit = false;
+
+  // Going forward, stop at an (interface, destination prefix) pair another
+  // trace has already followed, going backward at any known interface
+  for (int probe = 0; probe < PROBES_PER_HOP; probe++) {
+    uint32_t interface = hop[probe].reply_addr;
+    if (interface == 0 || interface == target->address) {
+      continue;
+    } else if (forward) {
+      uint64_t key = global_stop_key(interface, target->address);
+      hit = hit || stop_set_contains(global, key);
+    } else {
+      hit = hit || stop_set_contains(local, interface);
+    }
+  }
+
+  // Remember the interfaces only after all of the hop's probes are looked up,
+  // so repeated replies from one interface don't stop the trace
+  for (int probe = 0; probe < PROBES_PER_HOP; probe++) {
+    uint32_t interface = hop[probe].reply_addr;
+    if (interface != 0 && interface != target->address) {
+      stop_set_add(local, interface);
+      if (forward) {
+        stop_set_add(global, global_stop_key(interface, target->address));
+      }
+    }
+  }
+
+  return hit;
+}
+
+void trace_doubletree(ProbeEngine *engine, StopSet *global) {
+  const TraceOptions *options = engine->options;
+  uint32_t per_target = engine->max_hops * PROBES_PER_HOP;
+  StopSet local = {0};
+
+  // Every target starts at the middle TTL, going forward from it and backward
+  // from the hop before it
+  int start_ttl = options->start_ttl < engine->max_hops ? options->start_ttl
+                                                         : engine->max_hops;
+  for (int i = 0; i < engine->count; i++) {
+    engine->targets[i].forward = start_ttl;
+    engine->targets[i].backward = start_ttl - 1;
+  }
+
+  // Room for a forward and a backward hop of every target per round
+  uint32_t *slots = malloc((size_t)engine->count * 2 * PROBES_PER_HOP *
+                           sizeof(uint32_t));
+  if (!slots) {
+    perror("malloc");
+    return;
+  }
+
+  // Probe one hop in each direction per target and round, until every target
+  // has stopped in both directions
+  while (true) {
+    uint64_t total = 0;
+    for (int i = 0; i < engine->count; i++) {
+      TraceTarget *target = &engine->targets[i];
+      int hops[2] = {target->forward, target->backward};
+      for (int direction = 0; direction < 2; direction++) {
+        for (int probe = 0; hops[direction] && probe < PROBES_PER_HOP;
+             probe++) {
+          slots[total++] =
+              i * per_target + (hops[direction] - 1) * PROBES_PER_HOP + probe;
+        }
+      }
+    }
+    if (total == 0) {
+      break;
+    }
+    send_probes(engine, slots, total);
+
+    // Move each target on unless the hop it reached is already known
+    for (int i = 0; i < engine->count; i++) {
+      TraceTarget *target = &engine->targets[i];
+
+      if (target->backward) {
+        bool known = check_stop_set(target, target->backward, &local, global,
+                                    false);
+        target->backward = known ? 0 : target->backward - 1;
+      }
+
+      if (target->forward) {
+        int ttl = target->forward;
+        bool known = check_stop_set(target, ttl, &local, global, true);
+        bool done = (target->reached && ttl >= target->reached) ||
+                    (target->gap_stop && ttl >= target->gap_stop) ||
+                    ttl == engine->max_hops;
+        target->forward = known || done ? 0 : ttl + 1;
+      }
+    }
+  }
+
+  fprintf(stderr,
+          "doubletree: %llu probes sent, %zu interfaces, %zu stop set "
+          "entries\n",
+          (unsigned long long)engine->sent, local.count, global->count);
+
+  free(slots);
+  free(local.keys);
+}
+
+void print_target_results(TraceTarget *target, int max_hops, int dst_port) {
+  // Print the header in the same format as the classic mode, without DNS
+  char addrstr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &target->address, addrstr, sizeof addrstr);
+  printf("traceroute to %s (%s), %d hops max, TCP SYN to port %d\n",
+         target->name ? target->name : addrstr, addrstr, max_hops, dst_port);
+
+  // Print up to the destination, or the last hop that answered at all
+  int last = target->reached;
+  for (int ttl = max_hops; last == 0 && ttl > 0; ttl--) {
+    for (int probe = 0; probe < PROBES_PER_HOP; probe++) {
+      if (target->probes[(ttl - 1) * PROBES_PER_HOP + probe].reply_addr) {
+        last = ttl;
+      }
+    }
+  }
+
+  for (int ttl = 1; ttl <= last; ttl++) {
+    // Leave out hops Doubletree did not probe
+    ProbeResult *hop = &target->probes[(ttl - 1) * PROBES_PER_HOP];
+    if (hop[0].state == PROBE_UNSENT) {
+      continue;
+    }
+    printf("%2d ", ttl);
+
+    // Print each probe, repeating the address only when it changes
+    uint32_t previous = 0;
+    for (int probe = 0; probe < PROBES_PER_HOP; probe++) {
+      ProbeResult *result = &target->probes[(ttl - 1) * PROBES_PER_HOP + probe];
+      if (result->reply_addr == 0) {
+        printf(" *");
+        continue;
+      }
+      if (result->reply_addr != previous) {
+        inet_ntop(AF_INET, &result->reply_addr, addrstr, sizeof addrstr);
+        printf(" %s", addrstr);
+        previous = result->reply_addr;
+      }
+      printf("  %.3f ms", result->rtt);
+    }
+    printf("\n");
+  }
+}
+
+int run_multi_target(const TraceOptions *options, int raw_sock, int icmp_sock,
+                     int tcp_sock, TraceLog *log) {
+  int max_hops = options->max_hops;
+
+  // Read the target list
+  TraceTarget *targets;
+  int count;
+  if (load_targets(options->target_file, &targets, &count) < 0) {
+    return -1;
+  }
+
+  // Everything allocated from here on is freed at done, on success or error
+  ProbeResult *probes = NULL;
+  ProbeEngine *engine = NULL;
+  StopSet global = {0};
+  int status = -1;
+
+  // Each address is only traced once, replies can't tell copies apart
+  count = remove_duplicate_targets(targets, count);
+
+  if (count == 0) {
+    fprintf(stderr, "\nNo targets to trace\n");
+    goto done;
+  }
+
+  // Use the address of the interface that routes to the first target
+  struct sockaddr_in source;
+  if (find_source_address(targets[0].address, &source) < 0) {
+    goto done;
+  }
+  uint32_t src_addr = source.sin_addr.s_addr;
+
+  // Allocate the results for every probe in one block, all start unsent
+  size_t per_target = (size_t)max_hops * PROBES_PER_HOP;
+  if ((uint64_t)count * per_target >= TIMER_NONE ||
+      (uint64_t)count * per_target * sizeof(ProbeResult) > MAX_RESULT_BYTES) {
+    fprintf(stderr, "\nToo many targets to trace at once\n");
+    goto done;
+  }
+  probes = calloc(count * per_target, sizeof(ProbeResult));
+  if (!probes) {
+    perror("calloc");
+    goto done;
+  }
+  for (int i = 0; i < count; i++) {
+    targets[i].probes = &probes[i * per_target];
+  }
+
+  // Only let replies to our probes through to userspace
+  if (attach_reply_filters(icmp_sock, tcp_sock, src_addr, 0, max_hops) < 0) {
+    goto done;
+  }
+
+  fprintf(stderr, "tracing %d targets, %d hops max, %d probes/sec\n", count,
+          max_hops, options->rate);
+
+  // Probe every target concurrently
+  engine = create_engine(options, raw_sock, icmp_sock, tcp_sock, src_addr,
+                         targets, count, probes, log);
+  if (!engine) {
+    goto done;
+  }
+  // With "-D", skip hops already known from other targets or earlier runs
+  if (options->start_ttl > 0) {
+    if (options->stop_set_file &&
+        load_stop_set(options->stop_set_file, &global) < 0) {
+      goto done;
+    }
+    trace_doubletree(engine, &global);
+    if (options->stop_set_file) {
+      save_stop_set(options->stop_set_file, &global);
+    }
+  } else {
+    trace_targets(engine);
+  }
+
+  // Print the results in the order the targets were listed
+  for (int i = 0; i < count; i++) {
+    print_target_results(&targets[i], max_hops, options->dst_port);
+  }
+  status = 0;
+
+done:
+  if (engine) {
+    destroy_engine(engine);
+  }
+  free(global.keys);
+  for (int i = 0; i < count; i++) {
+    free(targets[i].name);
+  }
+  free(probes);
+  free(targets);
+  return status;
+}
+
+// Latency histograms keep HISTOGRAM_SUB_BITS significant bits of each value
+// in microseconds, so every bucket is within about 3% of the values in it
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF_COUNT (HISTOGRAM_SUB_COUNT / 2)
+#define HISTOGRAM_BUCKETS \
+  (HISTOGRAM_SUB_COUNT + (32 - HISTOGRAM_SUB_BITS) * HISTOGRAM_HALF_COUNT)
+
+// Define a struct for a fixed-size, HDR-style log-bucketed latency histogram
+typedef struct {
+  uint32_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;
+  double sum;
+  double min;
+  double max;
+} LatencyHistogram;
+
+int histogram_bucket(uint32_t value) {
+  // Small values each get their own bucket
+  if (value < HISTOGRAM_SUB_COUNT) {
+    return value;
+  }
+
+  // Larger values keep their top HISTOGRAM_SUB_BITS bits
+  int msb = 31 - __builtin_clz(value);
+  int shift = msb - (HISTOGRAM_SUB_BITS - 1);
+  int mantissa = value >> shift;
+  return HISTOGRAM_SUB_COUNT + (shift - 1) * HISTOGRAM_HALF_COUNT +
+         (mantissa - HISTOGRAM_HALF_COUNT);
+}
+
+double histogram_bucket_value(int bucket) {
+  // Small values are stored exactly
+  if (bucket < HISTOGRAM_SUB_COUNT) {
+    return bucket;
+  }
+
+  // Return the middle of the range of values the bucket holds
+  int shift = (bucket - HISTOGRAM_SUB_COUNT) / HISTOGRAM_HALF_COUNT + 1;
+  int mantissa = (bucket - HISTOGRAM_SUB_COUNT) % HISTOGRAM_HALF_COUNT +
+                 HISTOGRAM_HALF_COUNT;
+  return ((double)mantissa + 0.5) * (1u << shift);
+}
+
+void histogram_record(LatencyHistogram *histogram, double rtt) {
+  // Store the RTT in microseconds
+  double micros = rtt * 1000.0;
+  uint32_t value = micros <= 0 ? 0 : micros >= 4e9 ? 4000000000u : micros;
+  histogram->counts[histogram_bucket(value)]++;
+
+  // Keep the exact extremes and the sum for the mean
+  if (histogram->total == 0 || rtt < histogram->min) {
+    histogram->min = rtt;
+  }
+  if (histogram->total == 0 || rtt > histogram->max) {
+    histogram->max = rtt;
+  }
+  histogram->sum += rtt;
+  histogram->total++;
+}
+
+double histogram_percentile(const LatencyHistogram *histogram,
+                            double percentile) {
+  if (histogram->total == 0) {
+    return 0.0;
+  }
+
+  // Walk the buckets until the requested share of values is covered
+  uint64_t wanted = (uint64_t)(percentile / 100.0 * histogram->total + 0.5);
+  wanted = wanted < 1 ? 1 : wanted;
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    seen += histogram->counts[bucket];
+    if (seen >= wanted) {
+      // Report in milliseconds, clamped to the exact extremes
+      double value = histogram_bucket_value(bucket) / 1000.0;
+      value = value < histogram->min ? histogram->min : value;
+      return value > histogram->max ? histogram->max : value;
+    }
+  }
+
+  return histogram->max;
+}
+
+// Probes of the monitor mode are remembered in a ring per hop, indexed by
+// their round number
+#define MONITOR_RING 256
+
+// Define a struct for a probe of the monitor mode that may still be answered
+typedef struct {
+  uint32_t round;
+  double sent;
+  bool pending;
+} MonitorProbe;
+
+// Define a struct for the running statistics of one hop in the monitor mode
+typedef struct {
+  uint32_t last_addr;
+  uint64_t total_received;
+  uint64_t total_lost;
+  uint64_t received;
+  uint64_t lost;
+  LatencyHistogram histogram;
+  MonitorProbe ring[MONITOR_RING];
+} HopMonitor;
+
+// Set by SIGINT/SIGTERM to stop the monitor mode
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int signal_number) {
+  (void)signal_number;
+  stop_requested = 1;
+}
+
+void print_monitor_snapshot(const TraceOptions *options,
+                            struct sockaddr_in *destination, HopMonitor *hops,
+                            int hop_limit, uint32_t round) {
+  // Print a time-stamped header for the snapshot
+  char timestamp[32];
+  time_t now = time(NULL);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S",
+           localtime(&now));
+  printf("\n[%s] %s (%s), TCP SYN to port %d, %u rounds\n", timestamp,
+         options->target, inet_ntoa(destination->sin_addr), options->dst_port,
+         round);
+  printf("%3s  %-15s %6s %8s %9s %9s %9s %9s %9s\n", "hop", "host", "loss%",
+         "replies", "min", "p50", "p95", "p99", "max");
+
+  for (int ttl = 1; ttl <= hop_limit; ttl++) {
+    HopMonitor *hop = &hops[ttl - 1];
+    LatencyHistogram *histogram = &hop->histogram;
+
+    // Show the last address that answered at this hop
+    char addrstr[INET_ADDRSTRLEN] = "???";
+    if (hop->last_addr) {
+      inet_ntop(AF_INET, &hop->last_addr, addrstr, sizeof addrstr);
+    }
+
+    // Loss is over the probes of this interval that have been resolved
+    uint64_t resolved = hop->received + hop->lost;
+    double loss = resolved ? 100.0 * hop->lost / resolved : 0.0;
+
+    printf("%3d  %-15s %5.1f%% %8llu", ttl, addrstr, loss,
+           (unsigned long long)hop->received);
+    if (histogram->total > 0) {
+      printf(" %9.3f %9.3f %9.3f %9.3f %9.3f\n", histogram->min,
+             histogram_percentile(histogram, 50),
+             histogram_percentile(histogram, 95),
+             histogram_percentile(histogram, 99), histogram->max);
+    } else {
+      printf(" %9s %9s %9s %9s %9s\n", "*", "*", "*", "*", "*");
+    }
+
+    // Start the next interval from empty counters and histograms
+    hop->total_received += hop->received;
+    hop->total_lost += hop->lost;
+    hop->received = 0;
+    hop->lost = 0;
+    memset(histogram, 0, sizeof(LatencyHistogram));
+  }
+
+  fflush(stdout);
+}
+
+double monitor_reply(HopMonitor *hops, int max_hops, uint32_t seq,
+                     uint32_t reply_addr, double recv_time, int *hop_limit,
+                     bool final) {
+  // Find the probe from the TTL and round in the sequence number
+  int ttl = SEQ_TTL(seq);
+  uint32_t round = seq >> 8;
+  if (ttl < 1 || ttl > max_hops) {
+    return -1;
+  }
+  HopMonitor *hop = &hops[ttl - 1];
+  MonitorProbe *probe = &hop->ring[round % MONITOR_RING];
+
+  // Only count the first reply to a probe that has not timed out
+  if (!probe->pending || probe->round != round) {
+    return -1;
+  }
+  probe->pending = false;
+
+  // Record the reply in the hop's statistics
+  hop->received++;
+  hop->last_addr = reply_addr;
+  histogram_record(&hop->histogram, recv_time - probe->sent);
+
+  // Stop probing beyond the destination
+  if (final && ttl < *hop_limit) {
+    *hop_limit = ttl;
+  }
+
+  return recv_time - probe->sent;
+}
+
+int run_monitor(const TraceOptions *options, int raw_sock, int icmp_sock,
+                int tcp_sock, uint32_t src_addr,
+                struct sockaddr_in *destination, TraceLog *log) {
+  int max_hops = options->max_hops;
+
+  // Allocate the per-hop statistics
+  HopMonitor *hops = calloc(max_hops, sizeof(HopMonitor));
+  if (!hops) {
+    perror("calloc");
+    return -1;
+  }
+
+  // Stop cleanly on Ctrl-C or SIGTERM, printing a final snapshot
+  signal(SIGINT, request_stop);
+  signal(SIGTERM, request_stop);
+
+  // Watch both receive sockets with epoll, they are drained without blocking
+  int epoll_fd = epoll_create1(0);
+  int sockets[2] = {icmp_sock, tcp_sock};
+  for (int i = 0; i < 2; i++) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = sockets[i]};
+    fcntl(sockets[i], F_SETFL, fcntl(sockets[i], F_GETFL) | O_NONBLOCK);
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockets[i], &event);
+  }
+
+  // Build the probe once, only the per-hop fields change after this
+  char packet[PROBE_LENGTH];
+  build_probe_template(packet, src_addr, destination->sin_addr.s_addr,
+                       options->dst_port);
+
+  // Each round probes every hop once, spread evenly over the round
+  int hop_limit = max_hops;
+  uint32_t round = 0;
+  int next_ttl = 1;
+  double start = monotonic_ms();
+  double round_start = start;
+  double next_send = start;
+  double next_snapshot = start + options->monitor_interval * 1000.0;
+  double next_expire = start;
+
+  fprintf(stderr, "monitoring %s (%s), snapshot every %g s, Ctrl-C to stop\n",
+          options->target, inet_ntoa(destination->sin_addr),
+          options->monitor_interval);
+
+  while (!stop_requested) {
+    double now = monotonic_ms();
+
+    // Send the next probe of the round when it is due
+    if (now >= next_send) {
+      // Start a new round once every hop has been probed
+      if (next_ttl > hop_limit) {
+        next_ttl = 1;
+        round = (round + 1) & 0xffffff;
+        round_start += options->probe_interval;
+        if (round_start < now - options->probe_interval) {
+          round_start = now;
+        }
+      }
+
+      // Remember the probe until it is answered or times out
+      int ttl = next_ttl++;
+      HopMonitor *hop = &hops[ttl - 1];
+      MonitorProbe *probe = &hop->ring[round % MONITOR_RING];
+      if (probe->pending) {
+        hop->lost++;
+      }
+      probe->round = round;
+      probe->pending = true;
+
+      // Patch the TTL and round into the probe and send it
+      set_probe_fields(packet, ttl, probe_port(options, ttl),
+                       PROBE_SEQ(ttl, round));
+      probe->sent = monotonic_ms();
+      if (sendto(raw_sock, packet, PROBE_LENGTH, 0,
+                 (struct sockaddr *)destination, sizeof(*destination)) < 0) {
+        perror("sendto");
+        probe->pending = false;
+      } else {
+        log_probe(log, probe->sent, destination->sin_addr.s_addr, ttl,
+                  PROBE_SEQ(ttl, round), options->dst_port);
+      }
+
+      next_send = next_ttl > hop_limit
+                      ? round_start + options->probe_interval
+                      : round_start + (next_ttl - 1) *
+                                          options->probe_interval / hop_limit;
+    }
+
+    // Every 100 ms, count probes that have waited the longest time allowed
+    // as lost
+    if (now >= next_expire) {
+      for (int ttl = 1; ttl <= max_hops; ttl++) {
+        for (int i = 0; i < MONITOR_RING; i++) {
+          MonitorProbe *probe = &hops[ttl - 1].ring[i];
+          if (probe->pending && now - probe->sent > options->max_wait) {
+            probe->pending = false;
+            hops[ttl - 1].lost++;
+          }
+        }
+      }
+      next_expire = now + 100.0;
+    }
+
+    // Emit a snapshot when the interval is over
+    if (now >= next_snapshot) {
+      print_monitor_snapshot(options, destination, hops, hop_limit, round);
+      next_snapshot += options->monitor_interval * 1000.0;
+    }
+
+    // Sleep until the next probe or snapshot is due
+    double wake = next_send < next_snapshot ? next_send : next_snapshot;
+    int timeout = wake > now ? (int)(wake - now) + 1 : 0;
+    struct epoll_event events[2];
+    int ready = epoll_wait(epoll_fd, events, 2, timeout);
+
+    // Match every queued reply by the sequence number it quotes or acknowledges
+    for (int i = 0; i < ready; i++) {
+      char buffer[4096];
+      struct sockaddr_in recv_addr;
+      double recv_time;
+      uint32_t probe_dest, seq;
+      int read;
+
+      while ((read = receive_with_timestamp(events[i].data.fd, buffer,
+                                            sizeof(buffer), &recv_addr,
+                                            &recv_time)) > 0) {
+        uint32_t reply_addr = recv_addr.sin_addr.s_addr;
+        capture_packet(log, buffer, read, recv_time);
+
+        if (events[i].data.fd == icmp_sock) {
+          int type = parse_icmp_reply(options, (unsigned char *)buffer, read,
+                                      src_addr, &probe_dest, &seq);
+          if (type >= 0 && probe_dest == destination->sin_addr.s_addr) {
+            double rtt = monitor_reply(hops, max_hops, seq, reply_addr,
+                                       recv_time, &hop_limit, type == 3);
+            log_reply(log, (unsigned char *)buffer, read, recv_time,
+                      probe_dest, seq, reply_addr, rtt);
+          }
+        } else if (parse_tcp_reply(options, (unsigned char *)buffer, read,
+                                   &probe_dest, &seq) == 0 &&
+                   probe_dest == destination->sin_addr.s_addr) {
+          double rtt = monitor_reply(hops, max_hops, seq, probe_dest,
+                                     recv_time, &hop_limit, true);
+          log_reply(log, (unsigned char *)buffer, read, recv_time, probe_dest,
+                    seq, probe_dest, rtt);
+        }
+      }
+    }
+  }
+
+  // Print what was collected since the last snapshot
+  print_monitor_snapshot(options, destination, hops, hop_limit, round);
+
+  close(epoll_fd);
+  free(hops);
+  return 0;
+}
+
+// Define a struct for the reply to one probe of the classic mode
+typedef struct {
+  double rtt;
+  char addr[INET_ADDRSTRLEN];
+  char host[NI_MAXHOST];
+} HopReply;
+
+// Define a struct for the statistics of one hop collected over several runs
+typedef struct {
+  double *times;
+  int count;
+  int capacity;
+  int probes;
+  char **hosts;
+  int host_count;
+} HopStats;
+
+void print_hop(const HopReply *replies, int count) {
+  const char *previous = "*";
+
+  // Print each probe, repeating the host only when it changes
+  for (int i = 0; i < count; i++) {
+    const HopReply *reply = &replies[i];
+    const char *separator = i > 0 ? " " : "";
+
+    if (strcmp(reply->addr, "*") == 0) {
+      printf("%s*", separator);
+    } else if (strcmp(reply->addr, previous) != 0) {
+      printf("%s%s (%s)  %.3f ms", separator, reply->host, reply->addr,
+             reply->rtt);
+      previous = reply->addr;
+    } else {
+      printf("%s%.3f ms", separator, reply->rtt);
+    }
+  }
+  printf("\n");
+}
+
+int add_hop_stats(HopStats *stats, const HopReply *replies, int count) {
+  for (int i = 0; i < count; i++) {
+    const HopReply *reply = &replies[i];
+    stats->probes++;
+
+    // Lost probes only count towards the loss
+    if (strcmp(reply->addr, "*") == 0) {
+      continue;
+    }
+
+    // Grow the RTT array when it is full and add the RTT
+    if (stats->count == stats->capacity) {
+      int capacity = stats->capacity ? stats->capacity * 2 : 16;
+      double *times = realloc(stats->times, capacity * sizeof(double));
+      if (!times) {
+        perror("realloc");
+        return -1;
+      }
+      stats->times = times;
+      stats->capacity = capacity;
+    }
+    stats->times[stats->count++] = reply->rtt;
+
+    // Add the host in the "host (address)" form of the text output if new
+    char entry[NI_MAXHOST + INET_ADDRSTRLEN + 4];
+    snprintf(entry, sizeof(entry), "%s (%s)", reply->host, reply->addr);
+    bool seen = false;
+    for (int j = 0; j < stats->host_count && !seen; j++) {
+      seen = strcmp(stats->hosts[j], entry) == 0;
+    }
+    if (!seen) {
+      char **hosts =
+          realloc(stats->hosts, (stats->host_count + 1) * sizeof(char *));
+      if (!hosts || !(hosts[stats->host_count] = strdup(entry))) {
+        perror("malloc");
+        stats->hosts = hosts ? hosts : stats->hosts;
+        return -1;
+      }
+      stats->hosts = hosts;
+      stats->host_count++;
+    }
+  }
+
+  return 0;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double first = *(const double *)a;
+  double second = *(const double *)b;
+  return (first > second) - (first < second);
+}
+
+double sorted_percentile(const double *values, int count, double percentile) {
+  // Interpolate between the closest ranks, the 50th percentile is the median
+  double position = percentile / 100.0 * (count - 1);
+  int lower = (int)position;
+  if (lower >= count - 1) {
+    return values[count - 1];
+  }
+  double fraction = position - lower;
+  return values[lower] + fraction * (values[lower + 1] - values[lower]);
+}
+
+void write_json_string(FILE *fp, const char *text) {
+  // Quote the string, escaping the characters JSON requires
+  fputc('"', fp);
+  for (; *text; text++) {
+    if (*text == '"' || *text == '\\') {
+      fputc('\\', fp);
+    }
+    fputc(*text, fp);
+  }
+  fputc('"', fp);
+}
+
+int write_stats_json(const char *path, HopStats *stats, int max_hops) {
+  // Open the output file
+  FILE *fp = fopen(path, "w");
+
+  // Check that the output file was opened successfully
+  if (!fp) {
+    perror("fopen json output");
+    return -1;
+  }
+
+  // Write one object per hop that had replies, like trstats.py
+  bool first = true;
+  fprintf(fp, "[");
+  for (int hop = 1; hop <= max_hops; hop++) {
+    HopStats *hop_stats = &stats[hop - 1];
+    if (hop_stats->count == 0) {
+      continue;
+    }
+
+    // Sort the RTTs for the median and percentiles
+    double *times = hop_stats->times;
+    int count = hop_stats->count;
+    qsort(times, count, sizeof(double), compare_doubles);
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+      sum += times[i];
+    }
+
+    fprintf(fp, "%s\n {\n  \"avg\": %.4f,\n  \"hop\": %d,\n  \"hosts\": [",
+            first ? "" : ",", sum / count, hop);
+    for (int i = 0; i < hop_stats->host_count; i++) {
+      fprintf(fp, "%s\n   ", i ? "," : "");
+      write_json_string(fp, hop_stats->hosts[i]);
+    }
+    fprintf(fp,
+            "\n  ],\n  \"max\": %.4f,\n  \"med\": %.4f,\n  \"min\": %.4f,\n"
+            "  \"p25\": %.4f,\n  \"p75\": %.4f,\n  \"p95\": %.4f,\n"
+            "  \"loss\": %.4f\n }",
+            times[count - 1], sorted_percentile(times, count, 50), times[0],
+            sorted_percentile(times, count, 25),
+            sorted_percentile(times, count, 75),
+            sorted_percentile(times, count, 95),
+            1.0 - (double)count / hop_stats->probes);
+    first = false;
+  }
+  fprintf(fp, "\n]\n");
+
+  // Close the output file
+  fclose(fp);
+
+  return 0;
+}
+
+void free_hop_stats(HopStats *stats, int max_hops) {
+  for (int hop = 0; hop < max_hops; hop++) {
+    for (int i = 0; i < stats[hop].host_count; i++) {
+      free(stats[hop].hosts[i]);
+    }
+    free(stats[hop].hosts);
+    free(stats[hop].times);
+  }
+  free(stats);
+}
+
+int trace_classic(const TraceOptions *options, int raw_sock, int icmp_sock,
+                  int tcp_sock, struct sockaddr_in src_addr,
+                  struct sockaddr_in destination, HopStats *stats,
+                  TraceLog *log) {
+  // Build the probe once, only the per-hop fields change after this
+  char packet[PROBE_LENGTH];
+  build_probe_template(packet, src_addr.sin_addr.s_addr,
+                       destination.sin_addr.s_addr, options->dst_port);
+
+  // Define the RTT estimator for the adaptive timeouts and a count of
+  // consecutive hops without any reply
+  RttEstimator estimator = {0};
+  int silent_hops = 0;
+
+  // Start from 1 and iterate until max_hops
+  for (int hop = 1; hop <= options->max_hops; hop++) {
+    // Define variables for ending early
+    bool synack = false;
+    bool rst = false;
+    bool terminate = false;
+
+    // Print the hop number
+    printf("%2d  ", hop);
+
+    // Define variables for next loop
+    int answered = 0;
+    HopReply replies[PROBES_PER_HOP];
+
+    // Loop for three probes
+    for (int probe = 1; probe <= PROBES_PER_HOP; probe++) {
+      // Define local variables
+      double rtt = 0.0;
+      double send_time, recv_time;
+      char addrstr[INET_ADDRSTRLEN];
+      char host[NI_MAXHOST];
+
+      // No reply is shown as "*"
+      strcpy(addrstr, "*");
+
+      // Patch the TTL, source port and sequence number into the template, the
+      // checksums are updated incrementally
+      uint32_t expected_seq = PROBE_SEQ(hop, probe - 1);
+      set_probe_fields(packet, hop, probe_port(options, hop), expected_seq);
+
+      // Get the monotonic time and apply it to send_time before sending
+      send_time = monotonic_ms();
+
+      // Send the packet to the destination
+      int sent = sendto(raw_sock, packet, PROBE_LENGTH, 0,
+                        (struct sockaddr *)&destination, sizeof(destination));
+
+      // Check if the packet was sent successfully
+      if (sent < 0) {
+        perror("sendto");
+        return -1;
+      }
+      log_probe(log, send_time, destination.sin_addr.s_addr, hop,
+                expected_seq, options->dst_port);
+
+      // Wait until the timeout adapted to the RTTs seen so far runs out
+      double deadline =
+          send_time +
+          reply_timeout(&estimator, options->min_wait, options->max_wait);
+      bool matched = false;
+
+      // Keep listening until the reply to this probe arrives, late replies to
+      // earlier probes are skipped
+      while (!matched) {
+        // Stop once the deadline has passed
+        double remaining = deadline - monotonic_ms();
+        if (remaining <= 0) {
+          break;
+        }
+
+        // Define variable for storing sockets to listen to
+        fd_set readfds;
+
+        // Clear out the set, then add the ICMP and TCP sockets
+        FD_ZERO(&readfds);
+        FD_SET(icmp_sock, &readfds);
+        FD_SET(tcp_sock, &readfds);
+
+        // Define the max file descriptor then add 1 for select(), tcp_sock
+        // because created last
+        int maxfd = tcp_sock + 1;
+
+        // Define a time interval structure for setting the timeout for select()
+        struct timeval tv;
+
+        // Define the timeout as what is left until the deadline
+        tv.tv_sec = (long)(remaining / 1000);
+        tv.tv_usec = (long)((remaining - tv.tv_sec * 1000.0) * 1000);
+
+        // Listen to the ICMP and TCP sockets simultaneously
+        int rv = select(maxfd, &readfds, NULL, NULL, &tv);
+
+        // Handle the select() function return
+        if (rv == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+          perror("select");
+          break;
+        } else if (rv == 0) {
+          break;
+        }
+
+        // If the ICMP socket has data
+        if (FD_ISSET(icmp_sock, &readfds)) {
+          // Define local variables
+          char icmp_buffer[4096];
+          struct sockaddr_in recv_addr;
+          uint32_t probe_dest, seq;
+
+          // Read the data on the ICMP sockeet
+          int read = receive_with_timestamp(icmp_sock, icmp_buffer,
+                                            sizeof(icmp_buffer), &recv_addr,
+                                            &recv_time);
+
+          // Check if the data was received successfully
+          if (read < 0) {
+            perror("recvmsg");
+            return -1;
+          }
+          capture_packet(log, icmp_buffer, read, recv_time);
+
+          // Only accept the reply if it quotes this probe, late replies to
+          // earlier probes are logged with an unmatched RTT like "-T" does
+          bool parsed =
+              parse_icmp_reply(options, (unsigned char *)icmp_buffer, read,
+                               src_addr.sin_addr.s_addr, &probe_dest,
+                               &seq) >= 0;
+          if (parsed && seq != expected_seq) {
+            log_reply(log, (unsigned char *)icmp_buffer, read, recv_time,
+                      probe_dest, seq, recv_addr.sin_addr.s_addr, -1);
+          } else if (parsed) {
+            matched = true;
+
+            // Calculate the Round Trip Time (RTT) in milliseconds from the
+            // kernel arrival time
+            rtt = recv_time - send_time;
+            log_reply(log, (unsigned char *)icmp_buffer, read, recv_time,
+                      probe_dest, seq, recv_addr.sin_addr.s_addr, rtt);
+
+            // Convert the binary address to a string
+            inet_ntop(AF_INET, &recv_addr.sin_addr, addrstr, sizeof addrstr);
+
+            // Resolve the domain
+            int resolved =
+                getnameinfo((struct sockaddr *)&recv_addr, sizeof(recv_addr),
+                            host, sizeof(host), NULL, 0, NI_NAMEREQD);
+
+            // If the domain could not be resolved
+            if (resolved != 0) {
+              // Assign the host to be the IP
+              snprintf(host, sizeof(host), "%s", addrstr);
+            }
+          }
+        }
+
+        // If the TCP socket has data
+        if (!matched && FD_ISSET(tcp_sock, &readfds)) {
+          // Define local variables
+          char tcp_buffer[4096];
+          struct sockaddr_in recv_addr;
+          uint32_t reply_addr, seq;
+
+          // Read the data on the TCP socket
+          int read = receive_with_timestamp(tcp_sock, tcp_buffer,
+                                            sizeof(tcp_buffer), &recv_addr,
+                                            &recv_time);
+
+          // Check if the data was received successfully
+          if (read < 0) {
+            perror("recvmsg");
+            return -1;
+          }
+          capture_packet(log, tcp_buffer, read, recv_time);
+
+          // Only accept a SYN-ACK or RST from the destination that
+          // acknowledges this probe, log the others as unmatched
+          bool parsed = parse_tcp_reply(options, (unsigned char *)tcp_buffer,
+                                        read, &reply_addr, &seq) == 0;
+          if (parsed && (reply_addr != destination.sin_addr.s_addr ||
+                         seq != expected_seq)) {
+            log_reply(log, (unsigned char *)tcp_buffer, read, recv_time,
+                      reply_addr, seq, reply_addr, -1);
+          } else if (parsed) {
+            matched = true;
+
+            // Calculate the Round Trip Time (RTT) in milliseconds from the
+            // kernel arrival time
+            rtt = recv_time - send_time;
+            log_reply(log, (unsigned char *)tcp_buffer, read, recv_time,
+                      reply_addr, seq, reply_addr, rtt);
+
+            // Format the beginning of the received message to an IP header
+            struct iphdr *tcp_ip_header = (struct iphdr *)tcp_buffer;
+
+            // Get the length of the IP header
+            int tcp_ip_header_length = tcp_ip_header->ihl * 4;
+
+            // Format the message following the IP header to a TCP header
+            struct tcphdr *tcp_tcp_header =
+                (struct tcphdr *)(tcp_buffer + tcp_ip_header_length);
+
+            // Convert the binary address to a string
+            inet_ntop(AF_INET, &recv_addr.sin_addr, addrstr, sizeof addrstr);
+
+            // Resolve the domain
+            int resolved =
+                getnameinfo((struct sockaddr *)&recv_addr, sizeof(recv_addr),
+                            host, sizeof(host), NULL, 0, NI_NAMEREQD);
+
+            // If the domain could not be resolved
+            if (resolved != 0) {
               // Assign the host to be the IP
               snprintf(host, sizeof(host), "%s", addrstr);
             }
 
-            // Extract the SYN, ACK, and RST flags from the TCP header
-            // SYN/ACK or RST means we have reached the server
-            synack = (tcp_tcp_header->syn && tcp_tcp_header->ack);
-            rst = tcp_tcp_header->rst;
-          }
+            // Extract the SYN, ACK, and RST flags from the TCP header
+            // SYN/ACK or RST means we have reached the server
+            synack = (tcp_tcp_header->syn && tcp_tcp_header->ack);
+            rst = tcp_tcp_header->rst;
+          }
+        }
+      }
+
+      // Feed the RTT of a matched reply into the estimator
+      if (matched) {
+        update_rtt(&estimator, rtt);
+        answered++;
+      }
+
+      // Store the reply, the hop is printed once all probes are done
+      HopReply *reply = &replies[probe - 1];
+      reply->rtt = rtt;
+      strcpy(reply->addr, addrstr);
+      if (matched) {
+        snprintf(reply->host, sizeof(reply->host), "%s", host);
+      }
+    }
+
+    // Print the hop and add its replies to the statistics of all runs
+    print_hop(replies, PROBES_PER_HOP);
+    if (stats && add_hop_stats(&stats[hop - 1], replies, PROBES_PER_HOP) < 0) {
+      return -1;
+    }
+
+    // A SYN-ACK or RST means we have reached the destination
+    terminate = synack || rst;
+
+    // If we have received a SYNACK or RST, break
+    if (terminate) {
+      break;
+    }
+
+    // Count the hops in a row without a single reply and give up after
+    // gap_limit of them
+    silent_hops = answered == 0 ? silent_hops + 1 : 0;
+    if (options->gap_limit > 0 && silent_hops >= options->gap_limit) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+// MDA probes use flow IDs 1 to MDA_MAX_FLOWS, the flow ID is both the offset of
+// the source port and the probe number in the sequence number
+#define MDA_MAX_FLOWS PROBE_PORTS
+
+// Define a struct for what each flow found at one hop of a multipath trace
+typedef struct {
+  uint32_t addr[MDA_MAX_FLOWS + 1];
+  double sent[MDA_MAX_FLOWS + 1];
+  float rtt[MDA_MAX_FLOWS + 1];
+  uint8_t state[MDA_MAX_FLOWS + 1];
+} MultipathHop;
+
+// Define a struct for the state of a multipath trace
+typedef struct {
+  const TraceOptions *options;
+  int raw_sock;
+  int icmp_sock;
+  int tcp_sock;
+  uint32_t src_addr;
+  struct sockaddr_in *destination;
+  TraceLog *log;
+  char packet[PROBE_LENGTH];
+  RttEstimator estimator;
+  MultipathHop *hops;
+  int next_flow;
+  uint64_t probes;
+} MultipathTrace;
+
+int mda_probes_needed(int successors, double confidence) {
+  // Find the fewest probes that would have seen all of successors + 1 equally
+  // loaded next hops with the given confidence, so that seeing only
+  // successors after that many rules the extra next hop out
+  int hops = successors + 1;
+  double seen[MDA_MAX_FLOWS + 2] = {1.0};
+  for (int probes = 1; probes <= MDA_MAX_FLOWS; probes++) {
+    // seen[j] is the probability of having seen exactly j of the next hops
+    for (int j = hops; j > 0; j--) {
+      seen[j] = seen[j] * j / hops + seen[j - 1] * (hops - j + 1) / hops;
+    }
+    seen[0] = 0;
+    if (seen[hops] >= confidence) {
+      return probes;
+    }
+  }
+  return MDA_MAX_FLOWS;
+}
+
+void send_flow_probes(MultipathTrace *trace, const int *ttls, const int *flows,
+                      int count) {
+  const TraceOptions *options = trace->options;
+  uint32_t target = trace->destination->sin_addr.s_addr;
+  double interval = 1000.0 / options->rate;
+  int pending = 0;
+
+  // Send the probes at the configured rate
+  for (int i = 0; i < count; i++) {
+    int ttl = ttls[i];
+    int flow = flows[i];
+    MultipathHop *hop = &trace->hops[ttl - 1];
+    set_probe_fields(trace->packet, ttl, PROBE_BASE_PORT + flow,
+                     PROBE_SEQ(ttl, flow));
+
+    double sent = monotonic_ms();
+    if (sendto(trace->raw_sock, trace->packet, PROBE_LENGTH, 0,
+               (struct sockaddr *)trace->destination,
+               sizeof(*trace->destination)) < 0) {
+      perror("sendto");
+      hop->state[flow] = PROBE_EXPIRED;
+      continue;
+    }
+    log_probe(trace->log, sent, target, ttl, PROBE_SEQ(ttl, flow),
+              options->dst_port);
+    hop->sent[flow] = sent;
+    hop->state[flow] = PROBE_PENDING;
+    trace->probes++;
+    pending++;
+
+    // Wait for the next send slot
+    if (i + 1 < count) {
+      usleep((useconds_t)(interval * 1000));
+    }
+  }
+
+  // Collect replies until every probe is answered or the timeout runs out
+  double deadline = monotonic_ms() + reply_timeout(&trace->estimator,
+                                                   options->min_wait,
+                                                   options->max_wait);
+  while (pending > 0) {
+    double remaining = deadline - monotonic_ms();
+    if (remaining <= 0) {
+      break;
+    }
+
+    // Wait for either socket to have a reply
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(trace->icmp_sock, &readfds);
+    FD_SET(trace->tcp_sock, &readfds);
+    struct timeval tv;
+    tv.tv_sec = (long)(remaining / 1000);
+    tv.tv_usec = (long)((remaining - tv.tv_sec * 1000.0) * 1000);
+    if (select(trace->tcp_sock + 1, &readfds, NULL, NULL, &tv) <= 0) {
+      continue;
+    }
+
+    int sockets[2] = {trace->icmp_sock, trace->tcp_sock};
+    for (int i = 0; i < 2; i++) {
+      if (!FD_ISSET(sockets[i], &readfds)) {
+        continue;
+      }
+
+      // Read the reply and match it by the TTL and flow in its sequence number
+      unsigned char buffer[4096];
+      struct sockaddr_in recv_addr;
+      double recv_time;
+      uint32_t probe_dest, seq, reply_addr;
+      int read = receive_with_timestamp(sockets[i], (char *)buffer,
+                                        sizeof(buffer), &recv_addr,
+                                        &recv_time);
+      if (read < 0) {
+        continue;
+      }
+      capture_packet(trace->log, (char *)buffer, read, recv_time);
+      if (sockets[i] == trace->icmp_sock) {
+        if (parse_icmp_reply(options, buffer, read, trace->src_addr,
+                             &probe_dest, &seq) < 0) {
+          continue;
         }
+        reply_addr = recv_addr.sin_addr.s_addr;
+      } else if (parse_tcp_reply(options, buffer, read, &probe_dest, &seq) ==
+                 0) {
+        reply_addr = probe_dest;
+      } else {
+        continue;
       }
 
-      // If this is the first probe
-      if (probe == 1) {
-        // Assign the rtt and host and copy the address to the "first" variables
-        first_time = rtt;
-        strncpy(first_host, host, NI_MAXHOST);
-        strncpy(first_addr, addrstr, INET_ADDRSTRLEN);
-      }
-
-      // If this is the second probe
-      else if (probe == 2) {
-        // Assign rtt and host and copy the address to the "second" variables
-        second_time = rtt;
-        strncpy(second_host, host, NI_MAXHOST);
-        strncpy(second_addr, addrstr, INET_ADDRSTRLEN);
-      }
-
-      // If this is the third probe
-      else if (probe == 3) {
-        // Define booleans comparing the different addresses
-        bool first_second = strcmp(first_addr, second_addr) == 0;
-        bool first_third = strcmp(first_addr, addrstr) == 0;
-        bool second_third = strcmp(second_addr, addrstr) == 0;
-        bool first_invalid = strcmp(first_addr, "*") == 0;
-        bool second_invalid = strcmp(second_addr, "*") == 0;
-        bool third_invalid = strcmp(addrstr, "*") == 0;
-
-        // Print result based on different addresses
-        if (first_second && first_third && second_third) {
-          if (first_invalid) {
-            printf("* * *\n");
-          } else {
-            printf("%s (%s)  %.3f ms %.3f ms %.3f ms\n", host, addrstr,
-                   first_time, second_time, rtt);
-            if (synack || rst) {
-              terminate = true;
-            }
-          }
-        } else if (first_second && !first_third && !second_third) {
-          if (first_invalid) {
-            printf("* * %s (%s)  %.3f ms\n", host, addrstr, rtt);
-          } else if (third_invalid) {
-            printf("%s (%s)  %.3f ms  %.3f ms *\n", first_host, first_addr,
-                   first_time, second_time);
-          } else {
-            printf("%s (%s)  %.3f ms  %.3f ms %s (%s)  %.3f ms\n", first_host,
-                   first_addr, first_time, second_time, host, addrstr, rtt);
-          }
-        } else if (!first_second && first_third && !second_third) {
-          if (first_invalid) {
-            printf("* * %s (%s)  %.3f ms\n", second_host, second_addr,
-                   second_time);
-          } else if (second_invalid) {
-            printf("%s (%s)  %.3f ms  %.3f ms *\n", first_host, first_addr,
-                   first_time, rtt);
-          } else {
-            printf("%s (%s)  %.3f ms  %.3f ms %s (%s)  %.3f ms\n", host,
-                   addrstr, first_time, rtt, second_host, second_addr,
-                   second_time);
-          }
-        } else if (!first_second && !first_third && second_third) {
-          if (second_invalid) {
-            printf("* * %s (%s)  %.3f ms\n", first_host, first_addr,
-                   first_time);
-          } else if (first_invalid) {
-            printf("* %s (%s)  %.3f ms  %.3f ms\n", second_host, second_addr,
-                   second_time, rtt);
-          } else {
-            printf("%s (%s)  %.3f ms %s (%s)  %.3f ms  %.3f ms\n", first_host,
-                   first_addr, first_time, host, addrstr, second_time, rtt);
-          }
-        } else if (!first_second && !first_third && !second_third) {
-          if (first_invalid) {
-            printf("* %s (%s)  %.3f ms %s (%s) %.3f ms\n", second_host,
-                   second_addr, second_time, host, addrstr, rtt);
-          } else if (second_invalid) {
-            printf("%s (%s)  %.3f ms * %s (%s) %.3f ms\n", first_host,
-                   first_addr, first_time, host, addrstr, rtt);
-          } else if (third_invalid) {
-            printf("%s (%s)  %.3f ms %s (%s)  %.3f ms *\n", first_host,
-                   first_addr, first_time, second_host, second_addr,
-                   second_time);
-          } else {
-            printf("%s (%s)  %.3f ms %s (%s)  %.3f ms %s (%s) %.3f ms\n",
-                   first_host, first_addr, first_time, second_host, second_addr,
-                   second_time, host, addrstr, rtt);
-          }
+      // Log replies that match no outstanding probe with an unmatched RTT
+      int ttl = SEQ_TTL(seq);
+      int flow = SEQ_PROBE(seq);
+      MultipathHop *hop = NULL;
+      if (probe_dest == target && ttl >= 1 && ttl <= options->max_hops &&
+          flow >= 1) {
+        hop = &trace->hops[ttl - 1];
+      }
+      if (!hop || hop->state[flow] != PROBE_PENDING) {
+        log_reply(trace->log, buffer, read, recv_time, probe_dest, seq,
+                  reply_addr, -1);
+        continue;
+      }
+
+      // Keep the interface and RTT of the flow at this hop
+      hop->state[flow] = PROBE_ANSWERED;
+      hop->addr[flow] = reply_addr;
+      hop->rtt[flow] = recv_time - hop->sent[flow];
+      update_rtt(&trace->estimator, hop->rtt[flow]);
+      log_reply(trace->log, buffer, read, recv_time, probe_dest, seq,
+                reply_addr, hop->rtt[flow]);
+      pending--;
+    }
+  }
+
+  // Whatever is still waiting is lost
+  for (int i = 0; i < count; i++) {
+    MultipathHop *hop = &trace->hops[ttls[i] - 1];
+    if (hop->state[flows[i]] == PROBE_PENDING) {
+      hop->state[flows[i]] = PROBE_EXPIRED;
+    }
+  }
+}
+
+uint32_t flow_vertex(MultipathTrace *trace, int ttl, int flow) {
+  // A flow's vertex is the interface it went through at the previous hop, 0
+  // before the first hop or if that hop did not answer
+  if (ttl == 1) {
+    return 0;
+  }
+  MultipathHop *previous = &trace->hops[ttl - 2];
+  return previous->state[flow] == PROBE_ANSWERED ? previous->addr[flow] : 0;
+}
+
+void enumerate_hop(MultipathTrace *trace, int ttl) {
+  MultipathHop *hop = &trace->hops[ttl - 1];
+  MultipathHop *previous = ttl > 1 ? &trace->hops[ttl - 2] : NULL;
+  int ttls[2 * MDA_MAX_FLOWS];
+  int flows[2 * MDA_MAX_FLOWS];
+
+  while (true) {
+    int count = 0;
+    int new_flows = 0;
+
+    // Find the vertices at the previous hop, flows that were not answered
+    // there only count as a vertex of their own if no flow was
+    uint32_t vertices[MDA_MAX_FLOWS + 1];
+    int vertex_count = 0;
+    for (int flow = 1; flow < trace->next_flow; flow++) {
+      if (previous && previous->state[flow] == PROBE_UNSENT) {
+        continue;
+      }
+      uint32_t vertex = flow_vertex(trace, ttl, flow);
+      bool seen = false;
+      for (int i = 0; i < vertex_count && !seen; i++) {
+        seen = vertices[i] == vertex;
+      }
+      if (!seen && (vertex != 0 || vertex_count == 0)) {
+        vertices[vertex_count++] = vertex;
+      }
+    }
+    if (vertex_count > 1 && vertices[0] == 0) {
+      vertices[0] = vertices[--vertex_count];
+    }
+    if (vertex_count == 0) {
+      vertices[vertex_count++] = 0;
+    }
+
+    // Each vertex needs enough of its flows probed at this hop to rule out
+    // one more next hop than it has shown so far
+    for (int i = 0; i < vertex_count; i++) {
+      uint32_t successors[MDA_MAX_FLOWS + 1];
+      int successor_count = 0;
+      int probed = 0;
+      for (int flow = 1; flow < trace->next_flow; flow++) {
+        if ((previous && previous->state[flow] == PROBE_UNSENT) ||
+            flow_vertex(trace, ttl, flow) != vertices[i] ||
+            hop->state[flow] == PROBE_UNSENT) {
+          continue;
+        }
+        probed++;
+        bool seen = hop->state[flow] != PROBE_ANSWERED;
+        for (int j = 0; j < successor_count && !seen; j++) {
+          seen = successors[j] == hop->addr[flow];
+        }
+        if (!seen) {
+          successors[successor_count++] = hop->addr[flow];
+        }
+      }
+      int missing =
+          mda_probes_needed(successor_count > 0 ? successor_count : 1,
+                            trace->options->confidence) -
+          probed;
+
+      // Probe the vertex's flows that have not been probed at this hop yet
+      for (int flow = 1; missing > 0 && flow < trace->next_flow; flow++) {
+        bool queued = false;
+        for (int j = 0; j < count && !queued; j++) {
+          queued = flows[j] == flow && ttls[j] == ttl;
         }
+        if (!queued && hop->state[flow] == PROBE_UNSENT &&
+            (!previous || previous->state[flow] != PROBE_UNSENT) &&
+            flow_vertex(trace, ttl, flow) == vertices[i]) {
+          ttls[count] = ttl;
+          flows[count++] = flow;
+          missing--;
+        }
+      }
+
+      // Reaching the vertex with more flows needs new flow IDs, probed at both
+      // hops since they may go through any vertex
+      if (missing > new_flows) {
+        new_flows = missing;
       }
     }
 
-    // If we have received a SYNACK or RST, break
-    if (terminate) {
+    // Add the new flows unless all of them are used up
+    for (int i = 0; i < new_flows && trace->next_flow <= MDA_MAX_FLOWS; i++) {
+      int flow = trace->next_flow++;
+      if (previous) {
+        ttls[count] = ttl - 1;
+        flows[count++] = flow;
+      }
+      ttls[count] = ttl;
+      flows[count++] = flow;
+    }
+
+    // Stop once nothing more is needed, or nothing more can be probed
+    if (count == 0) {
+      break;
+    }
+    send_flow_probes(trace, ttls, flows, count);
+  }
+}
+
+bool print_multipath_hop(MultipathTrace *trace, int ttl) {
+  MultipathHop *hop = &trace->hops[ttl - 1];
+  uint32_t target = trace->destination->sin_addr.s_addr;
+  bool printed[MDA_MAX_FLOWS + 1] = {false};
+  bool reached = false;
+  bool first = true;
+  int silent = 0;
+
+  // Print each interface once, with the number of flows through it, its
+  // lowest RTT and the interfaces before it on those flows
+  for (int flow = 1; flow < trace->next_flow; flow++) {
+    if (hop->state[flow] == PROBE_EXPIRED) {
+      silent++;
+    }
+    if (hop->state[flow] != PROBE_ANSWERED || printed[flow]) {
+      continue;
+    }
+
+    uint32_t addr = hop->addr[flow];
+    int flow_count = 0;
+    float rtt = hop->rtt[flow];
+    uint32_t predecessors[MDA_MAX_FLOWS + 1];
+    int predecessor_count = 0;
+    for (int other = flow; other < trace->next_flow; other++) {
+      if (hop->state[other] != PROBE_ANSWERED || hop->addr[other] != addr) {
+        continue;
+      }
+      printed[other] = true;
+      flow_count++;
+      rtt = hop->rtt[other] < rtt ? hop->rtt[other] : rtt;
+
+      uint32_t vertex = flow_vertex(trace, ttl, other);
+      bool seen = vertex == 0;
+      for (int i = 0; i < predecessor_count && !seen; i++) {
+        seen = predecessors[i] == vertex;
+      }
+      if (!seen) {
+        predecessors[predecessor_count++] = vertex;
+      }
+    }
+    reached = reached || addr == target;
+
+    char addrstr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, addrstr, sizeof(addrstr));
+    if (first) {
+      printf("%2d  ", ttl);
+      first = false;
+    } else {
+      printf("    ");
+    }
+    printf("%-15s %9.3f ms  %3d flow%s", addrstr, rtt, flow_count,
+           flow_count == 1 ? " " : "s");
+    for (int i = 0; i < predecessor_count; i++) {
+      inet_ntop(AF_INET, &predecessors[i], addrstr, sizeof(addrstr));
+      printf("%s%s", i == 0 ? "  <- " : ", ", addrstr);
+    }
+    printf("\n");
+  }
+
+  // Flows without any reply are counted on their own line
+  if (silent > 0) {
+    if (first) {
+      printf("%2d  ", ttl);
+    } else {
+      printf("    ");
+    }
+    printf("%-15s %12s  %3d flow%s\n", "*", "", silent,
+           silent == 1 ? "" : "s");
+  }
+  return reached;
+}
+
+int run_multipath(const TraceOptions *options, int raw_sock, int icmp_sock,
+                  int tcp_sock, uint32_t src_addr,
+                  struct sockaddr_in *destination, TraceLog *log) {
+  // Define the trace state with a table of flows for every hop
+  MultipathTrace trace = {.options = options,
+                          .raw_sock = raw_sock,
+                          .icmp_sock = icmp_sock,
+                          .tcp_sock = tcp_sock,
+                          .src_addr = src_addr,
+                          .destination = destination,
+                          .log = log,
+                          .next_flow = 1};
+  trace.hops = calloc(options->max_hops, sizeof(MultipathHop));
+  if (!trace.hops) {
+    perror("calloc");
+    return -1;
+  }
+
+  // Build the probe once, only the per-hop fields change after this
+  build_probe_template(trace.packet, src_addr, destination->sin_addr.s_addr,
+                       options->dst_port);
+
+  char addrstr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &destination->sin_addr, addrstr, sizeof(addrstr));
+  printf("multipath traceroute to %s (%s), %d hops max, %.0f%% confidence, "
+         "TCP SYN to port %d\n",
+         options->target, addrstr, options->max_hops,
+         options->confidence * 100, options->dst_port);
+
+  // Enumerate the interfaces of each hop in turn, until the destination
+  // answers or too many hops in a row stay silent
+  int silent_hops = 0;
+  for (int ttl = 1; ttl <= options->max_hops; ttl++) {
+    enumerate_hop(&trace, ttl);
+    bool reached = print_multipath_hop(&trace, ttl);
+    fflush(stdout);
+    if (reached) {
+      break;
+    }
+
+    bool answered = false;
+    for (int flow = 1; flow < trace.next_flow && !answered; flow++) {
+      answered = trace.hops[ttl - 1].state[flow] == PROBE_ANSWERED;
+    }
+    silent_hops = answered ? 0 : silent_hops + 1;
+    if (options->gap_limit > 0 && silent_hops >= options->gap_limit) {
       break;
     }
   }
+  printf("%llu probes, %d flows\n", (unsigned long long)trace.probes,
+         trace.next_flow - 1);
 
+  free(trace.hops);
   return 0;
 }
+
+int main(int argc, char *argv[]) {
+  // Define defaults for command-line arguments
+  TraceOptions options = {.max_hops = 30,
+                          .dst_port = 80,
+                          .target = "google.com",
+                          .target_file = NULL,
+                          .rate = 1000,
+                          .min_wait = 250,
+                          .max_wait = 3500,
+                          .gap_limit = 5,
+                          .monitor_interval = 0,
+                          .probe_interval = 1000,
+                          .runs = 1,
+                          .run_delay = 0,
+                          .json_output = NULL,
+                          .log_file = NULL,
+                          .pcap_file = NULL,
+                          .start_ttl = 0,
+                          .stop_set_file = NULL,
+                          .packet_ring = false,
+                          .paris = false,
+                          .multipath = false,
+                          .confidence = 0.95};
+  bool help = false;
+  bool benchmark = false;
+  char *decode_file = NULL;
+  bool decode_json = false;
+
+  // Parse passed arguments, if any
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-m") == 0) {
+      options.max_hops = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-p") == 0) {
+      options.dst_port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-t") == 0) {
+      options.target = argv[++i];
+    } else if (strcmp(argv[i], "-T") == 0) {
+      options.target_file = argv[++i];
+    } else if (strcmp(argv[i], "-r") == 0) {
+      options.rate = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-w") == 0) {
+      options.max_wait = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-W") == 0) {
+      options.min_wait = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-g") == 0) {
+      options.gap_limit = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-M") == 0) {
+      options.monitor_interval = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-i") == 0) {
+      options.probe_interval = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0) {
+      options.runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-d") == 0) {
+      options.run_delay = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0) {
+      options.json_output = argv[++i];
+    } else if (strcmp(argv[i], "-D") == 0) {
+      options.start_ttl = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-S") == 0) {
+      options.stop_set_file = argv[++i];
+    } else if (strcmp(argv[i], "-k") == 0) {
+      options.packet_ring = true;
+    } else if (strcmp(argv[i], "-F") == 0) {
+      options.paris = true;
+    } else if (strcmp(argv[i], "-A") == 0) {
+      options.multipath = true;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      options.confidence = atof(argv[++i]) / 100;
+    } else if (strcmp(argv[i], "-L") == 0) {
+      options.log_file = argv[++i];
+    } else if (strcmp(argv[i], "-P") == 0) {
+      options.pcap_file = argv[++i];
+    } else if (strcmp(argv[i], "-R") == 0) {
+      decode_file = argv[++i];
+    } else if (strcmp(argv[i], "-j") == 0) {
+      decode_json = true;
+    } else if (strcmp(argv[i], "-B") == 0) {
+      benchmark = true;
+    } else if (strcmp(argv[i], "-h") == 0) {
+      help = true;
+    }
+  }
+
+  // Display message and return if "-h" specified
+  if (help) {
+    printf(
+        "usage: tcp_traceroute [-m MAX_HOPS] [-p DST_PORT] [-r RATE]\n"
+        "                      [-w MAX_WAIT] [-W MIN_WAIT] [-g GAP_LIMIT]\n"
+        "                      [-M SNAPSHOT_SECS] [-i INTERVAL] [-n RUNS]\n"
+        "                      [-d DELAY] [-o OUTPUT] [-L LOG_FILE]\n"
+        "                      [-P PCAP_FILE] [-R LOG_FILE [-j]]\n"
+        "                      [-D START_TTL [-S STOP_SET_FILE]] [-k] [-F]\n"
+        "                      [-A [-c CONFIDENCE]] [-B]\n"
+        "                      (-t TARGET | -T TARGET_FILE)\n\n"
+        "optional arguments:\n"
+        "-h, --help   show this help message and exit\n"
+        "-m   MAX_HOPS  Max hops to probe (default = 30)\n"
+        "-p   DST_PORT  TCP destination port (default = 80)\n"
+        "-t   TARGET    Target domain or IP\n"
+        "-T   TARGET_FILE  Trace every domain, IP or CIDR prefix listed in\n"
+        "                  TARGET_FILE (one per line, \"-\" for stdin)\n"
+        "-r   RATE      Max probes per second with -T and -A\n"
+        "               (default = 1000)\n"
+        "-w   MAX_WAIT  Max time to wait for a reply in ms (default = 3500)\n"
+        "-W   MIN_WAIT  Min time to wait for a reply in ms (default = 250)\n"
+        "-g   GAP_LIMIT Stop after this many silent hops, 0 = never\n"
+        "               (default = 5)\n"
+        "-M   SNAPSHOT_SECS  Keep monitoring TARGET and print per-hop loss\n"
+        "                    and latency percentiles every SNAPSHOT_SECS\n"
+        "-i   INTERVAL  Time in ms between probes to a hop with -M\n"
+        "               (default = 1000)\n"
+        "-n   RUNS      Number of times to trace TARGET (default = 1)\n"
+        "-d   DELAY     Time in seconds between runs (default = 0)\n"
+        "-o   OUTPUT    Write the per-hop RTT statistics of all runs as JSON\n"
+        "               to the OUTPUT file\n"
+        "-D   START_TTL Trace -T targets Doubletree-style, starting at\n"
+        "               START_TTL and stopping at hops already known\n"
+        "-S   STOP_SET_FILE  Load the global stop set of -D from and save it\n"
+        "                    to STOP_SET_FILE\n"
+        "-k             Read -T replies from a memory-mapped packet ring\n"
+        "-F             Paris traceroute, keep the flow of all probes fixed\n"
+        "-A             Find every load-balanced path to TARGET with the\n"
+        "               Multipath Detection Algorithm\n"
+        "-c   CONFIDENCE  Confidence in percent that -A found every next hop\n"
+        "                 (default = 95)\n"
+        "-L   LOG_FILE  Archive every probe and reply as a 32-byte binary\n"
+        "               record in LOG_FILE\n"
+        "-P   PCAP_FILE Capture the raw replies in PCAP_FILE\n"
+        "-R   LOG_FILE  Decode LOG_FILE to text instead of tracing\n"
+        "-j             Decode LOG_FILE to JSON lines with -R\n"
+        "-B             Benchmark and cross-check the checksum code\n");
+    return 0;
+  }
+
+  // Check the hop limit, the TTL is stored in 8 bits of the sequence number
+  if (options.max_hops < 1 || options.max_hops > 255) {
+    fprintf(stderr, "\nMAX_HOPS must be between 1 and 255\n");
+    return -1;
+  }
+
+  // Check the multipath confidence
+  if (options.confidence <= 0 || options.confidence >= 1) {
+    fprintf(stderr, "\nCONFIDENCE must be between 0 and 100\n");
+    return -1;
+  }
+
+  // Check the probe rate, it paces both "-T" and "-A"
+  if (options.rate <= 0) {
+    fprintf(stderr, "\nThe probe rate must be positive\n");
+    return -1;
+  }
+
+  // "-A" traces a single target once and picks the flow of every probe
+  // itself, so it can't be combined with the other modes or with "-F"
+  if (options.multipath &&
+      (options.target_file || options.monitor_interval > 0 ||
+       options.runs > 1 || options.json_output || options.start_ttl > 0 ||
+       options.packet_ring || options.paris)) {
+    fprintf(stderr, "\n-A can't be combined with -T, -M, -n, -o, -D, -k or "
+                    "-F\n");
+    return -1;
+  }
+
+  // Check the monitor mode timings
+  if (options.monitor_interval < 0 || options.probe_interval <= 0) {
+    fprintf(stderr, "\nThe snapshot and probe intervals must be positive\n");
+    return -1;
+  }
+
+  // Check the Doubletree start TTL
+  if (options.start_ttl < 0) {
+    fprintf(stderr, "\nSTART_TTL must not be negative\n");
+    return -1;
+  }
+
+  // Check the number of runs and the delay between them
+  if (options.runs < 1 || options.run_delay < 0) {
+    fprintf(stderr, "\nRUNS must be positive and DELAY not negative\n");
+    return -1;
+  }
+
+  // Check the reply timeout bounds
+  if (options.min_wait <= 0 || options.max_wait < options.min_wait) {
+    fprintf(stderr, "\nThe wait times must satisfy 0 < MIN_WAIT <= MAX_WAIT\n");
+    return -1;
+  }
+
+  // Run the checksum microbenchmark instead of tracing if "-B" specified
+  if (benchmark) {
+    return run_checksum_benchmark();
+  }
+
+  // Decode a binary trace log instead of tracing if "-R" specified
+  if (decode_file) {
+    return decode_trace_log(decode_file, decode_json);
+  }
+
+  // Define a raw socket to send, AF_INET=IPv4, IPPROTO_RAW=Manual IP header
+  int raw_sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+
+  // Check that the raw socket was created successfully
+  if (raw_sock < 0) {
+    printf(
+        "\nFailed to create raw socket, make sure you are executing as root\n");
+    return -1;
+  }
+
+  // Tell OS that we are building our own IP headers
+  int one = 1;
+  setsockopt(raw_sock, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one));
+
+  // Define socket to listen for TTL expirations, IPPROTO_ICMP=ICMP packets
+  int icmp_sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+
+  // Check that the raw socket was created successfully
+  if (icmp_sock < 0) {
+    printf(
+        "\nFailed to create raw socket, make sure you are executing as root\n");
+    return -1;
+  }
+
+  // Define a raw socket to listen for TCP SYN-ACK, IPPROTO_TCP=TCP packets
+  int tcp_sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+
+  // Check that the raw socket was created successfully
+  if (tcp_sock < 0) {
+    printf(
+        "\nFailed to create raw socket, make sure you are executing as root\n");
+    return -1;
+  }
+
+  // Have the kernel timestamp replies on arrival so RTTs exclude our wakeup
+  enable_receive_timestamps(icmp_sock);
+  enable_receive_timestamps(tcp_sock);
+
+  // Open the binary log and pcap outputs, if any
+  TraceLog trace_log;
+  if (open_trace_log(&trace_log, options.log_file, options.pcap_file) < 0) {
+    return -1;
+  }
+
+  // Trace every listed target concurrently if "-T" specified
+  if (options.target_file) {
+    int status =
+        run_multi_target(&options, raw_sock, icmp_sock, tcp_sock, &trace_log);
+    if (close_trace_log(&trace_log) < 0) {
+      status = -1;
+    }
+    return status;
+  }
+
+  // // Make a writable copy of the target domain/IP
+  char *target_copy = strdup(options.target);
+
+  // Point where there is "://", if any
+  char *host = strstr(target_copy, "://");
+
+  // If there is "://", change the pointer to exclude it
+  if (host != NULL) {
+    host += 3;
+  }
+
+  // If there is not "://", point to the beginning of the domain/IP
+  else {
+    host = options.target;
+  }
+
+  // Find if there is a "/" after the domain name
+  char *slash = strchr(host, '/');
+
+  // If there is a "/"
+  if (slash) {
+    // Place a null terminator so the host pointer excludes the path
+    *slash = '\0';
+  }
+
+  // Define struct for domain
+  struct addrinfo hints, *res;
+
+  // Fill hints with zeros so that we can specidy sokcet type
+  memset(&hints, 0, sizeof hints);
+
+  // Define hints, AF_INET=IPV4, SOCK_STREAM=TCP
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  // Get the resolved URL or IP address
+  int ip = getaddrinfo(host, NULL, &hints, &res);
+
+  // Check that the URL resolved correctly
+  if (ip != 0) {
+    fprintf(stderr, "\nCouldn't resolve URL or IP: %s\n", gai_strerror(ip));
+    return -1;
+  }
+
+  // Define struct for destination address
+  struct sockaddr_in destination;
+
+  // Define destination, htons() converts destination port to big-endian
+  destination.sin_family = AF_INET;
+  destination.sin_port = htons(options.dst_port);
+
+  // Cast the binary IP to a sockaddr_in struct and define sin_addr
+  destination.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+
+  // Define struct for the local IP address, the one that routes to the target
+  struct sockaddr_in src_addr;
+  if (find_source_address(destination.sin_addr.s_addr, &src_addr) < 0) {
+    return -1;
+  }
+
+  // Only let replies to our probes, and segments from the target, through,
+  // the source port is the flow ID instead of the TTL with "-A"
+  int filter_ports = options.multipath ? MDA_MAX_FLOWS : options.max_hops;
+  if (attach_reply_filters(icmp_sock, tcp_sock, src_addr.sin_addr.s_addr,
+                           destination.sin_addr.s_addr, filter_ports) < 0) {
+    return -1;
+  }
+
+  // Enumerate the load-balanced paths if "-A" specified
+  if (options.multipath) {
+    int status = run_multipath(&options, raw_sock, icmp_sock, tcp_sock,
+                               src_addr.sin_addr.s_addr, &destination,
+                               &trace_log);
+    if (close_trace_log(&trace_log) < 0) {
+      status = -1;
+    }
+    return status;
+  }
+
+  // Keep monitoring the path if "-M" specified
+  if (options.monitor_interval > 0) {
+    int status = run_monitor(&options, raw_sock, icmp_sock, tcp_sock,
+                             src_addr.sin_addr.s_addr, &destination,
+                             &trace_log);
+    if (close_trace_log(&trace_log) < 0) {
+      status = -1;
+    }
+    return status;
+  }
+
+  // Define the per-hop statistics when there is more than one run or the
+  // results are written as JSON
+  HopStats *stats = NULL;
+  if (options.runs > 1 || options.json_output) {
+    stats = calloc(options.max_hops, sizeof(HopStats));
+    if (!stats) {
+      perror("calloc");
+      close_trace_log(&trace_log);
+      return -1;
+    }
+  }
+
+  // Trace the path once per run, waiting run_delay between runs
+  bool failed = false;
+  for (int run = 0; run < options.runs; run++) {
+    if (run > 0) {
+      usleep((useconds_t)(options.run_delay * 1000000));
+      printf("\n");
+    }
+
+    printf("traceroute to %s (%s), %d hops max, TCP SYN to port %d\n",
+           options.target, inet_ntoa(destination.sin_addr), options.max_hops,
+           options.dst_port);
+
+    // Stop if the run could not be completed
+    if (trace_classic(&options, raw_sock, icmp_sock, tcp_sock, src_addr,
+                      destination, stats, &trace_log) < 0) {
+      failed = true;
+      break;
+    }
+  }
+
+  int status = close_trace_log(&trace_log) < 0 || failed ? -1 : 0;
+
+  // Write the min, median, percentiles and max RTT of every hop as JSON,
+  // unless a run failed and the statistics are incomplete
+  if (stats) {
+    if (options.json_output && !failed) {
+      if (write_stats_json(options.json_output, stats, options.max_hops) < 0) {
+        status = -1;
+      }
+    }
+    free_hop_stats(stats, options.max_hops);
+  }
+
+  return status;
+}